@@ -0,0 +1,66 @@
+#include <assert.h>
+#include "arena.h"
+
+/*
+ * Bump allocator for what lives as long as one request. The first block is
+ * kept when the arena is reset, so a recycled request allocates nothing
+ * unless it needs more than that; what does not fit goes to blocks of its
+ * own, freed on reset and counted in arena->mallocs.
+ */
+
+#define ARENA_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+typedef struct arena_block_s {
+    struct arena_block_s *next;
+    char data[1];
+} arena_block_t;
+
+void arena_init(arena_t *arena, size_t size)
+{
+    arena->base = malloc(size);
+    assert(arena->base);
+    arena->size = size;
+    arena->used = 0;
+    arena->blocks = NULL;
+    arena->mallocs = 0;
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    arena_block_t *block;
+    void *p;
+    size = ARENA_ALIGN(size);
+
+    if (arena->used + size <= arena->size) {
+        p = arena->base + arena->used;
+        arena->used += size;
+        return p;
+    }
+
+    block = malloc(offsetof(arena_block_t, data) + size);
+    assert(block);
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->mallocs++;
+    return block->data;
+}
+
+void arena_reset(arena_t *arena)
+{
+    arena_block_t *block, *next;
+
+    for (block = arena->blocks; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+
+    arena->blocks = NULL;
+    arena->used = 0;
+}
+
+void arena_destroy(arena_t *arena)
+{
+    arena_reset(arena);
+    free(arena->base);
+    arena->base = NULL;
+}
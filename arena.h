@@ -0,0 +1,11 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include "h.h"
+
+void arena_init(arena_t *arena, size_t size);
+void *arena_alloc(arena_t *arena, size_t size);
+void arena_reset(arena_t *arena);
+void arena_destroy(arena_t *arena);
+
+#endif
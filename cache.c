@@ -0,0 +1,150 @@
+#include <string.h>
+#include <assert.h>
+#include "cache.h"
+#include "loop.h"
+#include "conf.h"
+
+/*
+ * Tail cache. Each lane of a queue keeps a copy of the payloads of its
+ * newest CACHE_SLOTS messages, put there by PUT. A GET that keeps up with
+ * the PUTs finds its messages in there and takes them over instead of
+ * having the storage job read them back. Payloads are dropped once getpos
+ * passes them, and the loop holds at most cache_size bytes of them over all
+ * its queues: the oldest of a lane make room for a new one, and one that
+ * still does not fit is left out. Messages of a delay, which the storage
+ * job moves without the loop seeing them, are never cached.
+ */
+
+static void cache_free(cache_t *cache, uint64_t pos)
+{
+    size_t i = pos & (CACHE_SLOTS - 1);
+
+    if (cache->slots[i].data) {
+        loop_self->cache_bytes -= cache->slots[i].len;
+        free(cache->slots[i].data);
+        cache->slots[i].data = NULL;
+    }
+}
+
+/* forget the oldest n payloads of a lane */
+static void cache_shift(cache_t *cache, uint64_t n)
+{
+    for (; n && cache->count; n--) {
+        cache_free(cache, cache->first++);
+        cache->count--;
+    }
+}
+
+/* a message was put to a lane at pos, its putpos */
+void cache_put(queue_t *queue, int lane, uint64_t pos, const char *data, size_t len)
+{
+    cache_t *cache = queue->lanes[lane].cache;
+    size_t i = pos & (CACHE_SLOTS - 1);
+
+    if (!conf->cache_size) {
+        return;
+    }
+
+    if (!cache) {
+        cache = queue->lanes[lane].cache = malloc(sizeof(cache_t));
+        assert(cache);
+        memset(cache->slots, 0, sizeof(cache->slots));
+        cache->count = 0;
+    }
+
+    if (cache->count && pos != cache->first + cache->count) {
+        /* messages came in that went past the cache */
+        cache_shift(cache, cache->count);
+    }
+
+    if (!cache->count) {
+        cache->first = pos;
+    }
+
+    if (cache->count == CACHE_SLOTS) {
+        cache_shift(cache, 1);
+    }
+
+    cache->count++;
+
+    while (cache->count > 1 && loop_self->cache_bytes + len > conf->cache_size) {
+        cache_shift(cache, 1);
+    }
+
+    if (loop_self->cache_bytes + len > conf->cache_size) {
+        return;
+    }
+
+    cache->slots[i].data = malloc(len ? len : 1);
+    assert(cache->slots[i].data);
+    memcpy(cache->slots[i].data, data, len);
+    cache->slots[i].len = len;
+    loop_self->cache_bytes += len;
+}
+
+/* hand the payload of the message at pos to item, returns 0 if it is not cached */
+int cache_take(queue_t *queue, uint64_t pos, dbi_t *item)
+{
+    cache_t *cache = LANE_OF(pos) < QUEUE_LANES ? queue->lanes[LANE_OF(pos)].cache : NULL;
+    size_t i = pos & (CACHE_SLOTS - 1);
+
+    if (!cache || pos < cache->first || pos - cache->first >= cache->count || !cache->slots[i].data) {
+        loop_self->cache_misses++;
+        return 0;
+    }
+
+    item->data = cache->slots[i].data;
+    item->len = cache->slots[i].len;
+    item->data_is_malloced = 1;
+    loop_self->cache_bytes -= cache->slots[i].len;
+    loop_self->cache_hits++;
+    cache->slots[i].data = NULL;
+    return 1;
+}
+
+/* whether the next n messages a GET takes, highest priority first, are all cached */
+int cache_covers(queue_t *queue, uint64_t n)
+{
+    cache_t *cache;
+    lane_t *lane;
+    uint64_t pos;
+    int i;
+
+    for (i = QUEUE_LANES - 1; i >= 0 && n; i--) {
+        lane = &queue->lanes[i];
+
+        for (pos = lane->getpos; pos < lane->putpos && n; pos++, n--) {
+            cache = lane->cache;
+
+            if (!cache || pos < cache->first || pos - cache->first >= cache->count || !cache->slots[pos & (CACHE_SLOTS - 1)].data) {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+/* getpos of a lane moved to pos */
+void cache_trim(queue_t *queue, int lane, uint64_t pos)
+{
+    cache_t *cache = queue->lanes[lane].cache;
+
+    if (cache && cache->count && pos > cache->first) {
+        cache_shift(cache, pos - cache->first);
+    }
+}
+
+/* forget every payload of a queue, e.g. when its positions start over */
+void cache_drop(queue_t *queue)
+{
+    int i;
+
+    for (i = 0; i < QUEUE_LANES; i++) {
+        if (queue->lanes[i].cache) {
+            cache_shift(queue->lanes[i].cache, queue->lanes[i].cache->count);
+            free(queue->lanes[i].cache);
+            queue->lanes[i].cache = NULL;
+        }
+    }
+}
@@ -0,0 +1,12 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include "h.h"
+
+void cache_put(queue_t *queue, int lane, uint64_t pos, const char *data, size_t len);
+int cache_take(queue_t *queue, uint64_t pos, dbi_t *item);
+int cache_covers(queue_t *queue, uint64_t n);
+void cache_trim(queue_t *queue, int lane, uint64_t pos);
+void cache_drop(queue_t *queue);
+
+#endif
@@ -1,6 +1,7 @@
 #include "conf.h"
 #include <string.h>
 #include <stdio.h>
+#include <inttypes.h>
 
 conf_t conf[1] = {{
         engine_leveldb, /* engine */
@@ -10,10 +11,21 @@ conf_t conf[1] = {{
         10, /* tcp_keepalive */
         1, /* tcp_nodelay */
         0, /* delete_after_get */
+        0, /* group_commit_delay */
+        1024, /* group_commit_max */
+        1, /* threads */
+        16 * 1048576, /* 16MB, max_message_size */
+        durability_none, /* durability */
+        0, /* durability_interval */
+        {0, 0, 0}, /* retention */
+        64 * 1048576, /* 64MB, cache_size */
         128 * 1048576, /* 128MB, leveldb_cache_size */
         8 * 1024, /* 8KB, leveldb_block_size */
         8 * 1048576, /* 8MB, leveldb_write_buffer_size */
-        1024u * 1024u * 1024u * 2u /* 2GB, lmdb_mapsize */
+        1024u * 1024u * 1024u * 2u, /* 2GB, lmdb_mapsize */
+        1024u * 1024u * 1024u, /* 1GB, lmdb_mapsize_step */
+        (size_t)64 << 30, /* 64GB, lmdb_mapsize_max */
+        0 /* lmdb_queue_dbs */
     },
 };
 
@@ -25,11 +37,24 @@ void conf_init(conf_t *conf)
     conf->tcp_keepalive = 10;
     conf->tcp_nodelay = 1;
     conf->delete_after_get = 0;
+    conf->group_commit_delay = 0;
+    conf->group_commit_max = 1024;
+    conf->threads = 1;
+    conf->max_message_size = 16 * 1048576; /* 16MB */
+    conf->durability = durability_none;
+    conf->durability_interval = 0;
+    conf->retention.max_length = 0;
+    conf->retention.max_bytes = 0;
+    conf->retention.max_age = 0;
+    conf->cache_size = 64 * 1048576; /* 64MB */
     conf->db = strdup("./db");
     conf->leveldb_cache_size = 128 * 1048576; /* 128MB */
     conf->leveldb_block_size = 8 * 1024; /* 8KB */
     conf->leveldb_write_buffer_size = 8 * 1048576; /* 8MB */
     conf->lmdb_mapsize = 1024u * 1024u * 1024u * 2u; /* 2GB */
+    conf->lmdb_mapsize_step = 1024u * 1024u * 1024u; /* 1GB */
+    conf->lmdb_mapsize_max = (size_t)64 << 30; /* 64GB */
+    conf->lmdb_queue_dbs = 0;
 }
 
 int conf_loadfile(conf_t *conf, char *filename)
@@ -90,6 +115,44 @@ int conf_loadfile(conf_t *conf, char *filename)
         else if (!strcmp(k, "delete_after_get")) {
             sscanf(v, "%u", &conf->delete_after_get);
         }
+        else if (!strcmp(k, "group_commit_delay")) {
+            sscanf(v, "%u", &conf->group_commit_delay);
+        }
+        else if (!strcmp(k, "group_commit_max")) {
+            sscanf(v, "%u", &conf->group_commit_max);
+        }
+        else if (!strcmp(k, "threads")) {
+            sscanf(v, "%u", &conf->threads);
+        }
+        else if (!strcmp(k, "max_message_size")) {
+            sscanf(v, "%zu", &conf->max_message_size);
+        }
+        else if (!strcmp(k, "durability")) {
+            if (!strcmp(v, "none")) {
+                conf->durability = durability_none;
+            }
+            else if (!strcmp(v, "always")) {
+                conf->durability = durability_always;
+            }
+            else if (sscanf(v, "interval=%u", &conf->durability_interval) == 1 && conf->durability_interval) {
+                conf->durability = durability_interval;
+            }
+            else {
+                terrx(1, "durability is one of none, interval=<ms>, always");
+            }
+        }
+        else if (!strcmp(k, "max_length")) {
+            sscanf(v, "%"SCNu64, &conf->retention.max_length);
+        }
+        else if (!strcmp(k, "max_bytes")) {
+            sscanf(v, "%"SCNu64, &conf->retention.max_bytes);
+        }
+        else if (!strcmp(k, "max_age")) {
+            sscanf(v, "%"SCNu64, &conf->retention.max_age);
+        }
+        else if (!strcmp(k, "cache_size")) {
+            sscanf(v, "%zu", &conf->cache_size);
+        }
         else if (!strcmp(k, "leveldb_cache_size")) {
             sscanf(v, "%zu", &conf->leveldb_cache_size);
         }
@@ -102,6 +165,17 @@ int conf_loadfile(conf_t *conf, char *filename)
         else if (!strcmp(k, "lmdb_mapsize")) {
             sscanf(v, "%zu", &conf->lmdb_mapsize);
         }
+        else if (!strcmp(k, "lmdb_mapsize_step")) {
+            if (sscanf(v, "%zu", &conf->lmdb_mapsize_step) != 1 || !conf->lmdb_mapsize_step) {
+                terrx(1, "lmdb_mapsize_step must be more than 0");
+            }
+        }
+        else if (!strcmp(k, "lmdb_mapsize_max")) {
+            sscanf(v, "%zu", &conf->lmdb_mapsize_max);
+        }
+        else if (!strcmp(k, "lmdb_queue_dbs")) {
+            sscanf(v, "%u", &conf->lmdb_queue_dbs);
+        }
         else {
             twarnx("error in %s line %i", filename, line);
             return 1;
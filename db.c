@@ -1,28 +1,280 @@
 #include "db.h"
+#include "db_lmdb.h"
+#include "db_leveldb.h"
+#include "db_unqlite.h"
+#include "key.h"
+#include <string.h>
 #include <assert.h>
 
+dbi_t *(*db_get)(dbi_t *key);
+void (*db_mget)(dbi_t *keys, size_t n, dbi_t *items);
+void (*db_put)(dbi_t *key, dbi_t *val);
+void (*db_delete)(dbi_t *key);
+int (*db_write)(dbbatch_t *batch);
+int (*db_iterate)(dbi_t *start, db_iterate_cb cb, void *arg);
+void (*db_close)();
+void (*db_sync)();
+void (*db_unpin)(void *pin);
+int (*db_grow)();
+int (*db_growing)();
+int (*db_admit)(const char *name, size_t len);
+
+void db_init(engine_t engine)
+{
+    switch (engine) {
+        case engine_leveldb:
+            db_leveldb_init();
+            db_get = db_leveldb_get;
+            db_mget = db_leveldb_mget;
+            db_put = db_leveldb_put;
+            db_delete = db_leveldb_delete;
+            db_write = db_leveldb_write;
+            db_iterate = db_leveldb_iterate;
+            db_close = db_leveldb_close;
+            db_sync = db_leveldb_sync;
+            break;
+
+        case engine_lmdb:
+            db_lmdb_init();
+            db_get = db_lmdb_get;
+            db_mget = db_lmdb_mget;
+            db_put = db_lmdb_put;
+            db_delete = db_lmdb_delete;
+            db_write = db_lmdb_write;
+            db_iterate = db_lmdb_iterate;
+            db_close = db_lmdb_close;
+            db_sync = db_lmdb_sync;
+            db_unpin = db_lmdb_unpin;
+            db_grow = db_lmdb_grow;
+            db_growing = db_lmdb_growing;
+            db_admit = db_lmdb_admit;
+            break;
+
+        case engine_unqlite:
+            db_unqlite_init();
+            db_get = db_unqlite_get;
+            db_mget = db_unqlite_mget;
+            db_put = db_unqlite_put;
+            db_delete = db_unqlite_delete;
+            db_write = db_unqlite_write;
+            db_iterate = db_unqlite_iterate;
+            db_close = db_unqlite_close;
+            db_sync = db_unqlite_sync;
+            break;
+
+        default:
+            terrx(-1, "unsuppored db engine");
+    }
+}
+
+static int db_any_key(dbi_t *key, dbi_t *val, void *arg)
+{
+    (void)key;
+    (void)val;
+    *(int *)arg = 1;
+    return 1;
+}
+
+/*
+ * On-disk format of the opened db: the stored version, 1 for a db written
+ * before versions were recorded and 0 for an empty one.
+ */
+int db_format()
+{
+    char buf[MAX_KEY_LENGTH];
+    dbi_t k, *vp;
+    int version, any = 0;
+    k.data = buf;
+    k.len = key_version(buf);
+    vp = db_get(&k);
+
+    if (vp->err) {
+        terrx(1, "unable to read db format: %s", vp->err);
+    }
+
+    if (vp->data && vp->len == 1) {
+        version = (unsigned char)vp->data[0];
+        dbi_destroy(vp);
+        return version;
+    }
+
+    dbi_destroy(vp);
+    db_iterate(NULL, db_any_key, &any);
+    return any ? 1 : 0;
+}
+
+void db_set_format()
+{
+    char buf[MAX_KEY_LENGTH], version = KEY_FORMAT_VERSION;
+    dbi_t k, v;
+    k.data = buf;
+    k.len = key_version(buf);
+    v.data = &version;
+    v.len = 1;
+    db_put(&k, &v);
+}
+
 dbi_t *dbi_new()
 {
     dbi_t *item = malloc(sizeof(dbi_t));
     assert(item);
+    dbi_init(item);
+    return item;
+}
+
+void dbi_init(dbi_t *item)
+{
     item->err = NULL;
     item->data = NULL;
     item->len = 0;
     item->data_is_malloced = 1;
-    return item;
+    item->pin = NULL;
+}
+
+/* free what an item holds, but not the item */
+void dbi_clear(dbi_t *item)
+{
+    if (item->err) {
+        free(item->err);
+    }
+
+    if (item->data && item->data_is_malloced) {
+        free(item->data);
+    }
+
+    if (item->pin) {
+        db_unpin(item->pin);
+        item->pin = NULL;
+    }
+}
+
+/* give a pinned item a copy of its data of its own, and let go of the pin */
+void dbi_detach(dbi_t *item)
+{
+    char *data;
+
+    if (!item->pin) {
+        return;
+    }
+
+    data = malloc(item->len ? item->len : 1);
+    assert(data);
+    memcpy(data, item->data, item->len);
+    item->data = data;
+    item->data_is_malloced = 1;
+    db_unpin(item->pin);
+    item->pin = NULL;
 }
 
 void dbi_destroy(dbi_t *item)
 {
     if (item) {
-        if (item->err) {
-            free(item->err);
-        }
+        dbi_clear(item);
+        free(item);
+    }
+}
+
+/* bytewise order, the one leveldb and lmdb sort keys by */
+int dbi_compare(const char *a, size_t alen, const char *b, size_t blen)
+{
+    int r = memcmp(a, b, alen < blen ? alen : blen);
 
-        if (item->data && item->data_is_malloced) {
-            free(item->data);
+    if (r) {
+        return r;
+    }
+
+    return alen < blen ? -1 : alen > blen ? 1 : 0;
+}
+
+dbbatch_t *dbbatch_new()
+{
+    dbbatch_t *batch = malloc(sizeof(dbbatch_t));
+    assert(batch);
+    batch->ops_size = 16;
+    batch->ops = malloc(batch->ops_size * sizeof(dbop_t));
+    assert(batch->ops);
+    batch->nops = 0;
+    batch->buf_size = BUFSIZE;
+    batch->buf = malloc(batch->buf_size);
+    assert(batch->buf);
+    batch->buf_length = 0;
+    return batch;
+}
+
+/* keys and values are copied, so callers may release them right away */
+static dbop_t *dbbatch_append(dbbatch_t *batch, dbop_type_t type, dbi_t *key, dbi_t *val)
+{
+    dbop_t *op;
+    size_t need = batch->buf_length + key->len + (val ? val->len : 0);
+
+    if (batch->nops == batch->ops_size) {
+        batch->ops_size <<= 1;
+        batch->ops = realloc(batch->ops, batch->ops_size * sizeof(dbop_t));
+        assert(batch->ops);
+    }
+
+    if (need > batch->buf_size) {
+        while (need > batch->buf_size) {
+            batch->buf_size <<= 1;
         }
 
-        free(item);
+        batch->buf = realloc(batch->buf, batch->buf_size);
+        assert(batch->buf);
+    }
+
+    op = &batch->ops[batch->nops++];
+    op->type = type;
+    op->key_offset = batch->buf_length;
+    op->key_length = key->len;
+    memcpy(batch->buf + batch->buf_length, key->data, key->len);
+    batch->buf_length += key->len;
+    op->val_offset = batch->buf_length;
+    op->val_length = 0;
+
+    if (val) {
+        op->val_length = val->len;
+        memcpy(batch->buf + batch->buf_length, val->data, val->len);
+        batch->buf_length += val->len;
     }
+
+    return op;
+}
+
+void dbbatch_put(dbbatch_t *batch, dbi_t *key, dbi_t *val)
+{
+    dbbatch_append(batch, dbop_put, key, val);
+}
+
+void dbbatch_delete(dbbatch_t *batch, dbi_t *key)
+{
+    dbbatch_append(batch, dbop_delete, key, NULL);
+}
+
+void dbbatch_clear(dbbatch_t *batch)
+{
+    batch->nops = 0;
+    batch->buf_length = 0;
+}
+
+void dbbatch_destroy(dbbatch_t *batch)
+{
+    if (batch) {
+        free(batch->ops);
+        free(batch->buf);
+        free(batch);
+    }
+}
+
+/* db_write, making room as often as needed; nobody may hold pinned items */
+int db_commit(dbbatch_t *batch)
+{
+    int r;
+
+    while ((r = db_write(batch)) == DB_FULL) {
+        if (db_grow()) {
+            return -1;
+        }
+    }
+
+    return r;
 }
@@ -3,13 +3,50 @@
 
 #include "h.h"
 
+/* db_write could not fit the batch, db_grow makes room; from db_grow, not yet */
+#define DB_FULL 1
+
+typedef int (*db_iterate_cb)(dbi_t *key, dbi_t *val, void *arg);
+
+void db_init(engine_t engine);
+int db_format();
+void db_set_format();
+
 dbi_t *dbi_new();
+void dbi_init(dbi_t *item);
+void dbi_clear(dbi_t *item);
+void dbi_detach(dbi_t *item);
 void dbi_destroy();
+int dbi_compare(const char *a, size_t alen, const char *b, size_t blen);
+
+dbbatch_t *dbbatch_new();
+void dbbatch_put(dbbatch_t *batch, dbi_t *key, dbi_t *val);
+void dbbatch_delete(dbbatch_t *batch, dbi_t *key);
+void dbbatch_clear(dbbatch_t *batch);
+void dbbatch_destroy(dbbatch_t *batch);
+
+#define dbbatch_key(batch, op) ((batch)->buf + (op)->key_offset)
+#define dbbatch_val(batch, op) ((batch)->buf + (op)->val_offset)
+
+extern dbi_t *(*db_get)(dbi_t *key);
+extern void (*db_mget)(dbi_t *keys, size_t n, dbi_t *items);
+extern void (*db_put)(dbi_t *key, dbi_t *val);
+extern void (*db_delete)(dbi_t *key);
+extern int (*db_write)(dbbatch_t *batch);
+extern int (*db_iterate)(dbi_t *start, db_iterate_cb cb, void *arg);
+extern void (*db_close)();
+/* flush what was written so far to disk, for durability = interval */
+extern void (*db_sync)();
+/* only set by engines whose reads point into their storage */
+extern void (*db_unpin)(void *pin);
+/* only set by engines whose db_write can return DB_FULL */
+extern int (*db_grow)();
+/* only set by engines whose db_grow waits for pins: whether one is waiting */
+extern int (*db_growing)();
+/* only set by engines that limit the queues there can be, -1 if there is no room for one more */
+extern int (*db_admit)(const char *name, size_t len);
 
-dbi_t *(*db_get)(dbi_t *key);
-void (*db_put)(dbi_t *key, dbi_t *val);
-void (*db_delete)(dbi_t *key);
-void (*db_close)();
+int db_commit(dbbatch_t *batch);
 
 
 #endif
@@ -1,3 +1,5 @@
+#include <string.h>
+#include <assert.h>
 #include "leveldb/c.h"
 #include "db.h"
 
@@ -5,6 +7,10 @@ static leveldb_t *leveldb_db;
 static leveldb_options_t *leveldb_options;
 static leveldb_readoptions_t *leveldb_roptions;
 static leveldb_writeoptions_t *leveldb_woptions;
+/* fsyncs the log, for durability = interval */
+static leveldb_writeoptions_t *leveldb_soptions;
+/* set by every write not synced yet */
+static int leveldb_unsynced = 0;
 static leveldb_cache_t *leveldb_cache;
 static leveldb_filterpolicy_t *leveldb_filterpolicy;
 
@@ -33,6 +39,13 @@ void db_leveldb_init()
 
     leveldb_roptions = leveldb_readoptions_create();
     leveldb_woptions = leveldb_writeoptions_create();
+    leveldb_soptions = leveldb_writeoptions_create();
+    leveldb_writeoptions_set_sync(leveldb_soptions, 1);
+
+    if (conf->durability == durability_always) {
+        /* one fsync per write, i.e. per group commit */
+        leveldb_writeoptions_set_sync(leveldb_woptions, 1);
+    }
 }
 
 dbi_t *db_leveldb_get(dbi_t *key)
@@ -42,14 +55,170 @@ dbi_t *db_leveldb_get(dbi_t *key)
     return item;
 }
 
+/*
+ * Read several keys, which must be in ascending order, with a single
+ * iterator: consecutive queue items are adjacent on disk, so this is one
+ * seek and a short forward scan.
+ */
+void db_leveldb_mget(dbi_t *keys, size_t n, dbi_t *items)
+{
+    leveldb_iterator_t *it;
+    const char *ik, *iv;
+    size_t i, iklen, ivlen;
+    char *errstr = NULL;
+    int c = 0;
+
+    if (n == 1) {
+        /* a point lookup is cheaper than setting up an iterator */
+        dbi_init(&items[0]);
+        items[0].data = leveldb_get(leveldb_db, leveldb_roptions, keys[0].data, keys[0].len, &items[0].len, &items[0].err);
+        return;
+    }
+
+    it = leveldb_create_iterator(leveldb_db, leveldb_roptions);
+
+    if (n) {
+        leveldb_iter_seek(it, keys[0].data, keys[0].len);
+    }
+
+    for (i = 0; i < n; i++) {
+        dbi_init(&items[i]);
+
+        while (leveldb_iter_valid(it)) {
+            ik = leveldb_iter_key(it, &iklen);
+            c = dbi_compare(ik, iklen, keys[i].data, keys[i].len);
+
+            if (c >= 0) {
+                break;
+            }
+
+            leveldb_iter_next(it);
+        }
+
+        if (leveldb_iter_valid(it) && c == 0) {
+            iv = leveldb_iter_value(it, &ivlen);
+            items[i].data = malloc(ivlen ? ivlen : 1);
+            assert(items[i].data);
+            memcpy(items[i].data, iv, ivlen);
+            items[i].len = ivlen;
+            leveldb_iter_next(it);
+        }
+    }
+
+    leveldb_iter_get_error(it, &errstr);
+
+    if (errstr) {
+        for (i = 0; i < n; i++) {
+            if (!items[i].data) {
+                items[i].err = strdup(errstr);
+            }
+        }
+
+        free(errstr);
+    }
+
+    leveldb_iter_destroy(it);
+}
+
+/* visit keys from start, or from the first key, in order until cb returns non-zero */
+int db_leveldb_iterate(dbi_t *start, db_iterate_cb cb, void *arg)
+{
+    leveldb_iterator_t *it = leveldb_create_iterator(leveldb_db, leveldb_roptions);
+    char *errstr = NULL;
+    dbi_t k, v;
+    int r = 0;
+
+    if (start) {
+        leveldb_iter_seek(it, start->data, start->len);
+    }
+    else {
+        leveldb_iter_seek_to_first(it);
+    }
+
+    for (; leveldb_iter_valid(it); leveldb_iter_next(it)) {
+        k.data = (char *)leveldb_iter_key(it, &k.len);
+        v.data = (char *)leveldb_iter_value(it, &v.len);
+
+        if ((r = cb(&k, &v, arg))) {
+            break;
+        }
+    }
+
+    leveldb_iter_get_error(it, &errstr);
+
+    if (errstr) {
+        twarnx("leveldb iterator failed: %s", errstr);
+        free(errstr);
+        r = -1;
+    }
+
+    leveldb_iter_destroy(it);
+    return r;
+}
+
 void db_leveldb_put(dbi_t *key, dbi_t *val)
 {
     leveldb_put(leveldb_db, leveldb_woptions, key->data, key->len, val->data, val->len, NULL);
+    leveldb_unsynced = 1;
 }
 
 void db_leveldb_delete(dbi_t *key)
 {
     leveldb_delete(leveldb_db, leveldb_woptions, key->data, key->len, NULL);
+    leveldb_unsynced = 1;
+}
+
+int db_leveldb_write(dbbatch_t *batch)
+{
+    char *errstr = NULL;
+    size_t i;
+    dbop_t *op;
+    leveldb_writebatch_t *wb = leveldb_writebatch_create();
+
+    for (i = 0; i < batch->nops; i++) {
+        op = &batch->ops[i];
+
+        if (op->type == dbop_put) {
+            leveldb_writebatch_put(wb, dbbatch_key(batch, op), op->key_length, dbbatch_val(batch, op), op->val_length);
+        }
+        else {
+            leveldb_writebatch_delete(wb, dbbatch_key(batch, op), op->key_length);
+        }
+    }
+
+    leveldb_write(leveldb_db, leveldb_woptions, wb, &errstr);
+    leveldb_writebatch_destroy(wb);
+    leveldb_unsynced = 1;
+
+    if (errstr) {
+        twarnx("leveldb_write failed: %s", errstr);
+        free(errstr);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* fsync the log if anything was written since the last sync */
+void db_leveldb_sync()
+{
+    char *errstr = NULL;
+    leveldb_writebatch_t *wb;
+
+    if (!__sync_bool_compare_and_swap(&leveldb_unsynced, 1, 0)) {
+        return;
+    }
+
+    /* an empty batch written with sync set flushes the log up to here */
+    wb = leveldb_writebatch_create();
+    leveldb_write(leveldb_db, leveldb_soptions, wb, &errstr);
+    leveldb_writebatch_destroy(wb);
+
+    if (errstr) {
+        twarnx("leveldb sync failed: %s", errstr);
+        free(errstr);
+        leveldb_unsynced = 1;
+    }
 }
 
 void db_leveldb_close()
@@ -60,4 +229,5 @@ void db_leveldb_close()
     leveldb_options_destroy(leveldb_options);
     leveldb_readoptions_destroy(leveldb_roptions);
     leveldb_writeoptions_destroy(leveldb_woptions);
+    leveldb_writeoptions_destroy(leveldb_soptions);
 }
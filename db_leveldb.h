@@ -3,8 +3,12 @@
 
 void db_leveldb_init();
 dbi_t *db_leveldb_get(dbi_t *key);
+void db_leveldb_mget(dbi_t *keys, size_t n, dbi_t *items);
 void db_leveldb_put(dbi_t *key, dbi_t *val);
 void db_leveldb_delete(dbi_t *key);
+int db_leveldb_write(dbbatch_t *batch);
+int db_leveldb_iterate(dbi_t *start, db_iterate_cb cb, void *arg);
+void db_leveldb_sync();
 void db_leveldb_close();
 
 #endif
@@ -1,16 +1,457 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <errno.h>
+#include <assert.h>
+#include <alloca.h>
 #include "lmdb.h"
 #include "db.h"
+#include "key.h"
+#include "queue.h"
+
+#define LMDB_MAX_READERS 1024
+#define LMDB_IDLE_READERS 64
+#define LMDB_QDB_TABLE_SIZE 1024
+
+/*
+ * Read transactions are pooled: a released one is reset and renewed when
+ * it is taken again, which keeps its reader slot instead of setting up a
+ * new one. Items read by db_lmdb_mget point straight into the map and pin
+ * their transaction, so the snapshot stays valid, whatever writers do,
+ * until the reply is written and the items are cleared.
+ *
+ * A full map is grown by lmdb_mapsize_step, which remaps it and so needs
+ * every read transaction of the process to be done. db_lmdb_grow does not
+ * wait for that: while pins are left it only has reads copy their values
+ * from then on, and the write is retried later, once the replies holding
+ * the pins were written. Writers detach their own pins before growing.
+ * Pins are kept short for that: stream chunks and replies that wait behind
+ * others copy their values, and a connection that leaves a pinned write
+ * unfinished while the map waits to grow is closed.
+ */
+typedef struct lmdb_reader_s {
+    struct lmdb_reader_s *next;
+    MDB_txn *txn;
+    unsigned int refs; /* items pointing into the snapshot */
+    unsigned short copy : 1; /* taken while growing, must not pin */
+} lmdb_reader_t;
 
 static MDB_env *env;
 static MDB_dbi dbi = 0;
+static uv_mutex_t readers_lock;
+static lmdb_reader_t *readers = NULL;
+static size_t readers_idle = 0;
+static size_t readers_active = 0; /* in use or pinned */
+static int growing = 0;
+static uv_mutex_t write_lock;
+static size_t full_mapsize = 0; /* map size at the last MDB_MAP_FULL */
+
+/*
+ * With lmdb_queue_dbs, the items of every queue live in a database of
+ * their own, named after the queue and keyed by position as a native
+ * integer (MDB_INTEGERKEY): positions only grow, so puts go to the end of
+ * the tree with MDB_APPEND, which fills leaf pages densely and never
+ * splits one in the middle. Meta keys stay in the main database. Lanes
+ * share the database of their queue, and the keys of a lane above 0 are
+ * past those of lane 0, so MDB_APPEND is only used for a key past the
+ * highest one the database has.
+ *
+ * A queue is admitted, and counts against lmdb_queue_dbs, when its first
+ * PUT is accepted, so it is that PUT that fails once there are too many,
+ * not the write it would have been batched into. A database opened by a
+ * write is only visible to others once that write commits, and is gone
+ * again if it aborts, so entries record whether their write committed.
+ */
+#define LMDB_END_UNKNOWN UINT64_MAX
+
+typedef struct lmdb_qdb_s {
+    struct lmdb_qdb_s *next;
+    struct lmdb_qdb_s *txn_next; /* opened by the write in progress */
+    MDB_dbi dbi;
+    uint64_t end; /* past its highest position, only known to writers */
+    unsigned short opened : 1; /* dbi is valid, its write may not have committed */
+    unsigned short committed : 1;
+    size_t name_length;
+    char name[MAX_QNAME_LENGTH + 1];
+} lmdb_qdb_t;
+
+static lmdb_qdb_t *qdbs[LMDB_QDB_TABLE_SIZE];
+static size_t qdbs_count = 0; /* admitted, opened or not */
+static lmdb_qdb_t *qdbs_opened = NULL; /* guarded by write_lock */
+static uv_mutex_t qdbs_lock;
+
+/* with qdbs_lock held */
+static lmdb_qdb_t *db_lmdb_qdb_find(const char *name, size_t len)
+{
+    lmdb_qdb_t *q = qdbs[queue_hash(name, len) & (LMDB_QDB_TABLE_SIZE - 1)];
+
+    while (q && (q->name_length != len || memcmp(q->name, name, len))) {
+        q = q->next;
+    }
+
+    return q;
+}
+
+/* with qdbs_lock held, NULL if lmdb_queue_dbs are taken */
+static lmdb_qdb_t *db_lmdb_qdb_add(const char *name, size_t len)
+{
+    uint32_t h = queue_hash(name, len) & (LMDB_QDB_TABLE_SIZE - 1);
+    lmdb_qdb_t *q;
+
+    if (qdbs_count >= conf->lmdb_queue_dbs) {
+        return NULL;
+    }
+
+    q = malloc(sizeof(lmdb_qdb_t));
+    assert(q);
+    memcpy(q->name, name, len);
+    q->name[len] = 0;
+    q->name_length = len;
+    q->end = LMDB_END_UNKNOWN;
+    q->opened = 0;
+    q->committed = 0;
+    q->next = qdbs[h];
+    qdbs[h] = q;
+    qdbs_count++;
+    return q;
+}
+
+/* returns -1 if the queue would need a database and there is no room for one */
+int db_lmdb_admit(const char *name, size_t len)
+{
+    lmdb_qdb_t *q;
+
+    if (!conf->lmdb_queue_dbs) {
+        return 0;
+    }
+
+    uv_mutex_lock(&qdbs_lock);
+
+    if (!(q = db_lmdb_qdb_find(name, len))) {
+        q = db_lmdb_qdb_add(name, len);
+    }
+
+    uv_mutex_unlock(&qdbs_lock);
+    return q ? 0 : -1;
+}
+
+/*
+ * The database of a queue. Given a write transaction it is opened, and
+ * created if the write puts to it, otherwise only committed ones are found.
+ */
+static lmdb_qdb_t *db_lmdb_qdb(MDB_txn *txn, const char *name, size_t len, int create, int *r)
+{
+    lmdb_qdb_t *q;
+    MDB_dbi d;
+    int opened = 0, committed = 0;
+    uv_mutex_lock(&qdbs_lock);
+    q = db_lmdb_qdb_find(name, len);
+
+    if (!q && txn && create) {
+        /* a write that no PUT was admitted for, e.g. of a migration */
+        q = db_lmdb_qdb_add(name, len);
+
+        if (!q) {
+            uv_mutex_unlock(&qdbs_lock);
+            *r = MDB_DBS_FULL;
+            return NULL;
+        }
+    }
+
+    /* the flags share a word that the writer changes, and committed publishes dbi */
+    if (q) {
+        opened = q->opened;
+        committed = q->committed;
+    }
+
+    uv_mutex_unlock(&qdbs_lock);
+
+    if (!q || (txn ? !opened && !create : !committed)) {
+        *r = MDB_NOTFOUND;
+        return NULL;
+    }
+
+    *r = 0;
+
+    if (opened) {
+        return q;
+    }
+
+    *r = mdb_dbi_open(txn, q->name, MDB_CREATE | MDB_INTEGERKEY, &d);
+
+    if (*r) {
+        return NULL;
+    }
+
+    uv_mutex_lock(&qdbs_lock);
+    q->dbi = d;
+    q->opened = 1;
+    uv_mutex_unlock(&qdbs_lock);
+    q->end = 0;
+    q->txn_next = qdbs_opened;
+    qdbs_opened = q;
+    return q;
+}
+
+/* after a write: keep the databases it opened if it committed, forget them if not */
+static void db_lmdb_qdbs_settle(int committed)
+{
+    lmdb_qdb_t *q;
+    size_t i;
+    uv_mutex_lock(&qdbs_lock);
+
+    while ((q = qdbs_opened)) {
+        qdbs_opened = q->txn_next;
+
+        if (committed) {
+            q->committed = 1;
+        }
+        else {
+            /* still admitted, the next write that puts to it opens it again */
+            q->opened = 0;
+        }
+    }
+
+    /* the ends of what an aborted write put to are wrong */
+    for (i = 0; i < LMDB_QDB_TABLE_SIZE && !committed; i++) {
+        for (q = qdbs[i]; q; q = q->next) {
+            q->end = LMDB_END_UNKNOWN;
+        }
+    }
+
+    uv_mutex_unlock(&qdbs_lock);
+}
+
+/* find out where the keys of a queue database end, in a write transaction */
+static int db_lmdb_qdb_end(MDB_txn *txn, lmdb_qdb_t *q)
+{
+    MDB_cursor *cursor;
+    MDB_val k, v;
+    uint64_t pos;
+    int r = mdb_cursor_open(txn, q->dbi, &cursor);
+
+    if (r) {
+        return r;
+    }
+
+    r = mdb_cursor_get(cursor, &k, &v, MDB_LAST);
+
+    if (!r) {
+        memcpy(&pos, k.mv_data, sizeof(uint64_t));
+        q->end = pos + 1;
+    }
+    else if (r == MDB_NOTFOUND) {
+        q->end = 0;
+        r = 0;
+    }
+
+    mdb_cursor_close(cursor);
+    return r;
+}
+
+/*
+ * Where a key lives: the item of a queue in the database of the queue,
+ * under *pos, anything else in the main database as it is. *qdb is that
+ * of the queue, NULL for the main database. A queue that has no database
+ * gives MDB_NOTFOUND, unless txn is given and the key is to be put.
+ */
+static int db_lmdb_route(MDB_txn *txn, const char *key, size_t len, int create, MDB_dbi *d, MDB_val *k, uint64_t *pos, lmdb_qdb_t **qdb)
+{
+    const char *name;
+    size_t name_length;
+    lmdb_qdb_t *q;
+    int type, r;
+    *qdb = NULL;
+
+    if (conf->lmdb_queue_dbs && !key_parse(key, len, &name, &name_length, &type, pos) && type == KEYTYPE_ITEM) {
+        if (!(q = db_lmdb_qdb(txn, name, name_length, create, &r))) {
+            return r;
+        }
+
+        *d = q->dbi;
+        k->mv_size = sizeof(uint64_t);
+        k->mv_data = pos;
+        *qdb = q;
+        return 0;
+    }
+
+    *d = dbi;
+    k->mv_size = len;
+    k->mv_data = (char *)key;
+    return 0;
+}
+
+/* open the databases of the queues there are, so readers find them */
+static void db_lmdb_qdbs_load()
+{
+    MDB_txn *txn;
+    MDB_cursor *cursor;
+    MDB_val k, v;
+    const char *name;
+    size_t name_length, i, n = 0, size = 0;
+    char **names = NULL;
+    uint64_t pos;
+    int r, type;
+    r = mdb_txn_begin(env, NULL, 0, &txn);
+
+    if (!r) {
+        r = mdb_cursor_open(txn, dbi, &cursor);
+    }
+
+    if (r) {
+        terrx(r, "unable to read %s: %s", conf->db, mdb_strerror(r));
+    }
+
+    /* the records of named databases are keys of the main one too */
+    for (r = mdb_cursor_get(cursor, &k, &v, MDB_FIRST); !r; r = mdb_cursor_get(cursor, &k, &v, MDB_NEXT)) {
+        if (!key_parse(k.mv_data, k.mv_size, &name, &name_length, &type, &pos)) {
+            if (type == KEYTYPE_ITEM) {
+                terrx(1, "%s keeps items in the main database, it was not created with lmdb_queue_dbs", conf->db);
+            }
+
+            continue;
+        }
+
+        if (k.mv_size > MAX_QNAME_LENGTH || !k.mv_size || memchr(k.mv_data, 0, k.mv_size)) {
+            continue;
+        }
+
+        if (n == size) {
+            size = size ? size * 2 : 64;
+            names = realloc(names, size * sizeof(char *));
+            assert(names);
+        }
+
+        names[n] = malloc(k.mv_size + 1);
+        assert(names[n]);
+        memcpy(names[n], k.mv_data, k.mv_size);
+        names[n++][k.mv_size] = 0;
+    }
+
+    mdb_cursor_close(cursor);
+
+    for (i = 0; i < n; i++) {
+        lmdb_qdb_t *q = malloc(sizeof(lmdb_qdb_t));
+        assert(q);
+        r = mdb_dbi_open(txn, names[i], MDB_INTEGERKEY, &q->dbi);
+
+        if (r == MDB_INCOMPATIBLE || r == MDB_NOTFOUND) {
+            /* a key that is not ours, e.g. of the old text format */
+            free(q);
+            free(names[i]);
+            continue;
+        }
+
+        if (r) {
+            terrx(r, "unable to open queue database %s: %s", names[i], mdb_strerror(r));
+        }
+
+        q->name_length = strlen(names[i]);
+        memcpy(q->name, names[i], q->name_length + 1);
+        q->end = LMDB_END_UNKNOWN;
+        q->opened = 1;
+        q->committed = 1;
+        q->next = qdbs[queue_hash(q->name, q->name_length) & (LMDB_QDB_TABLE_SIZE - 1)];
+        qdbs[queue_hash(q->name, q->name_length) & (LMDB_QDB_TABLE_SIZE - 1)] = q;
+        qdbs_count++;
+        free(names[i]);
+    }
+
+    free(names);
+    r = mdb_txn_commit(txn);
+
+    if (r) {
+        terrx(r, "mdb_txn_commit failed: %s", mdb_strerror(r));
+    }
+}
+
+static void db_lmdb_reader_done()
+{
+    uv_mutex_lock(&readers_lock);
+
+    readers_active--;
+
+    uv_mutex_unlock(&readers_lock);
+}
+
+static lmdb_reader_t *db_lmdb_reader(int *r)
+{
+    lmdb_reader_t *reader;
+    int copy;
+    uv_mutex_lock(&readers_lock);
+    reader = readers;
+
+    if (reader) {
+        readers = reader->next;
+        readers_idle--;
+    }
+
+    readers_active++;
+    copy = growing;
+    uv_mutex_unlock(&readers_lock);
+
+    if (reader) {
+        *r = mdb_txn_renew(reader->txn);
+
+        if (!*r) {
+            reader->copy = copy;
+            return reader;
+        }
+
+        mdb_txn_abort(reader->txn);
+    }
+    else {
+        reader = malloc(sizeof(lmdb_reader_t));
+        assert(reader);
+    }
+
+    reader->refs = 0;
+    reader->copy = copy;
+    *r = mdb_txn_begin(env, NULL, MDB_RDONLY, &reader->txn);
+
+    if (*r) {
+        free(reader);
+        db_lmdb_reader_done();
+        return NULL;
+    }
+
+    return reader;
+}
+
+static void db_lmdb_reader_release(lmdb_reader_t *reader)
+{
+    mdb_txn_reset(reader->txn);
+    db_lmdb_reader_done();
+    uv_mutex_lock(&readers_lock);
+
+    if (readers_idle < LMDB_IDLE_READERS) {
+        reader->next = readers;
+        readers = reader;
+        readers_idle++;
+        reader = NULL;
+    }
+
+    uv_mutex_unlock(&readers_lock);
+
+    if (reader) {
+        mdb_txn_abort(reader->txn);
+        free(reader);
+    }
+}
+
+void db_lmdb_unpin(void *pin)
+{
+    lmdb_reader_t *reader = pin;
+
+    if (--reader->refs == 0) {
+        db_lmdb_reader_release(reader);
+    }
+}
 
 
 void db_lmdb_init()
 {
     int r;
+    unsigned int flags = MDB_WRITEMAP | MDB_NOTLS;
     MDB_txn *txn;
     r = mdb_env_create(&env);
 
@@ -26,8 +467,32 @@ void db_lmdb_init()
         }
     }
 
+    /* every GET in flight holds a reader until its reply is written */
+    r = mdb_env_set_maxreaders(env, LMDB_MAX_READERS);
+
+    if (r) {
+        terrx(r, "mdb_env_set_maxreaders failed: %s", mdb_strerror(r));
+    }
+
+    if (conf->lmdb_queue_dbs) {
+        r = mdb_env_set_maxdbs(env, conf->lmdb_queue_dbs);
+
+        if (r) {
+            terrx(r, "mdb_env_set_maxdbs failed: %s", mdb_strerror(r));
+        }
+    }
+
+    uv_mutex_init(&qdbs_lock);
+    uv_mutex_init(&readers_lock);
+    uv_mutex_init(&write_lock);
     mkdir(conf->db, 0755);
-    r = mdb_env_open(env, conf->db, MDB_WRITEMAP | MDB_MAPASYNC | MDB_NOTLS, 0664);
+
+    if (conf->durability != durability_always) {
+        /* commits leave flushing the map to the OS, or to db_lmdb_sync */
+        flags |= MDB_MAPASYNC;
+    }
+
+    r = mdb_env_open(env, conf->db, flags, 0664);
 
     if (r) {
         terrx(r, "mdb_env_open failed: %s", mdb_strerror(r));
@@ -49,28 +514,40 @@ void db_lmdb_init()
     }
 
     mdb_txn_commit(txn);
+
+    if (conf->lmdb_queue_dbs) {
+        db_lmdb_qdbs_load();
+    }
 }
 
+/* the value is copied, this is for the few reads outside of storage jobs */
 dbi_t *db_lmdb_get(dbi_t *key)
 {
-    MDB_txn *txn = NULL;
+    lmdb_reader_t *reader;
+    MDB_dbi d;
+    MDB_val k, v;
+    uint64_t pos;
+    lmdb_qdb_t *q;
     int r;
     dbi_t *item = dbi_new();
-    item->data_is_malloced = 0;
-    r = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
+    reader = db_lmdb_reader(&r);
 
-    if (r) {
-        goto error;
+    if (!reader) {
+        item->err = strdup(mdb_strerror(r));
+        return item;
     }
 
-    MDB_val k, v;
-    k.mv_size = key->len;
-    k.mv_data = key->data;
-    r = mdb_get(txn, dbi, &k, &v);
+    r = db_lmdb_route(NULL, key->data, key->len, 0, &d, &k, &pos, &q);
+
+    if (!r) {
+        r = mdb_get(reader->txn, d, &k, &v);
+    }
 
     switch (r) {
         case 0:
-            item->data = v.mv_data;
+            item->data = malloc(v.mv_size ? v.mv_size : 1);
+            assert(item->data);
+            memcpy(item->data, v.mv_data, v.mv_size);
             item->len = v.mv_size;
             break;
 
@@ -78,69 +555,368 @@ dbi_t *db_lmdb_get(dbi_t *key)
             break;
 
         default:
-            goto error;
+            item->err = strdup(mdb_strerror(r));
+            break;
     }
 
-    mdb_txn_abort(txn);
-    return item;
-error:
-    mdb_txn_abort(txn);
-    item->err = strdup(mdb_strerror(r));
+    db_lmdb_reader_release(reader);
     return item;
 }
 
-void db_lmdb_put(dbi_t *key, dbi_t *val)
+/*
+ * Read several keys of one queue, which must be in ascending order, with one cursor in
+ * one read transaction: a single B-tree descent and a walk along the leaves.
+ * Values are not copied, every item found pins the transaction, unless the
+ * map is being grown.
+ */
+void db_lmdb_mget(dbi_t *keys, size_t n, dbi_t *items)
 {
-    MDB_txn *txn = NULL;
-    int r;
-    r = mdb_txn_begin(env, NULL, 0, &txn);
+    lmdb_reader_t *reader;
+    MDB_cursor *cursor = NULL;
+    MDB_dbi d = dbi;
+    MDB_val k, v, *want = alloca(n * sizeof(MDB_val));
+    uint64_t *pos = alloca(n * sizeof(uint64_t));
+    size_t i;
+    lmdb_qdb_t *q;
+    int r, c = 0;
+    reader = db_lmdb_reader(&r);
 
-    if (r) {
-        return;
+    /* keys are of one queue, so in one database */
+    for (i = 0; i < n && !r; i++) {
+        r = db_lmdb_route(NULL, keys[i].data, keys[i].len, 0, &d, &want[i], &pos[i], &q);
+    }
+
+    if (!r) {
+        r = mdb_cursor_open(reader->txn, d, &cursor);
     }
 
+    if (!r && n) {
+        k = want[0];
+        r = mdb_cursor_get(cursor, &k, &v, MDB_SET_RANGE);
+    }
+
+    for (i = 0; i < n; i++) {
+        dbi_init(&items[i]);
+        items[i].data_is_malloced = 0;
+
+        while (!r) {
+            c = mdb_cmp(reader->txn, d, &k, &want[i]);
+
+            if (c >= 0) {
+                break;
+            }
+
+            r = mdb_cursor_get(cursor, &k, &v, MDB_NEXT);
+        }
+        if (!r && c == 0) {
+            if (reader->copy) {
+                items[i].data = malloc(v.mv_size ? v.mv_size : 1);
+                assert(items[i].data);
+                memcpy(items[i].data, v.mv_data, v.mv_size);
+                items[i].data_is_malloced = 1;
+            }
+            else {
+                items[i].data = v.mv_data;
+                items[i].pin = reader;
+                reader->refs++;
+            }
+
+            items[i].len = v.mv_size;
+            r = mdb_cursor_get(cursor, &k, &v, MDB_NEXT);
+        }
+        else if (r && r != MDB_NOTFOUND) {
+            items[i].err = strdup(mdb_strerror(r));
+        }
+    }
+
+    if (cursor) {
+        mdb_cursor_close(cursor);
+    }
+
+    if (reader && !reader->refs) {
+        db_lmdb_reader_release(reader);
+    }
+}
+
+/* visit keys from start, or from the first key, in order until cb returns non-zero */
+int db_lmdb_iterate(dbi_t *start, db_iterate_cb cb, void *arg)
+{
+    lmdb_reader_t *reader;
+    MDB_cursor *cursor = NULL;
     MDB_val k, v;
-    k.mv_size = key->len;
-    k.mv_data = key->data;
-    v.mv_size = val->len;
-    v.mv_data = val->data;
-    r = mdb_put(txn, dbi, &k, &v, 0);
+    dbi_t key, val;
+    int r, stop = 0;
+    reader = db_lmdb_reader(&r);
 
-    if (!r) {
-        mdb_txn_commit(txn);
+    if (!reader) {
+        twarnx("mdb_txn_begin failed: %s", mdb_strerror(r));
+        return -1;
+    }
+
+    r = mdb_cursor_open(reader->txn, dbi, &cursor);
+
+    if (r) {
+        db_lmdb_reader_release(reader);
+        twarnx("mdb_cursor_open failed: %s", mdb_strerror(r));
+        return -1;
+    }
+
+    if (start) {
+        k.mv_size = start->len;
+        k.mv_data = start->data;
+        r = mdb_cursor_get(cursor, &k, &v, MDB_SET_RANGE);
     }
     else {
-        mdb_txn_abort(txn);
+        r = mdb_cursor_get(cursor, &k, &v, MDB_FIRST);
+    }
+
+    while (!r) {
+        key.data = k.mv_data;
+        key.len = k.mv_size;
+        val.data = v.mv_data;
+        val.len = v.mv_size;
+
+        if ((stop = cb(&key, &val, arg))) {
+            break;
+        }
+
+        r = mdb_cursor_get(cursor, &k, &v, MDB_NEXT);
+    }
+
+    mdb_cursor_close(cursor);
+    db_lmdb_reader_release(reader);
+
+    if (r && r != MDB_NOTFOUND) {
+        twarnx("lmdb iterate failed: %s", mdb_strerror(r));
+        return -1;
     }
+
+    return stop;
+}
+
+void db_lmdb_put(dbi_t *key, dbi_t *val)
+{
+    dbbatch_t *batch = dbbatch_new();
+    dbbatch_put(batch, key, val);
+
+    if (db_commit(batch)) {
+        twarnx("lmdb put failed");
+    }
+
+    dbbatch_destroy(batch);
 }
 
 void db_lmdb_delete(dbi_t *key)
+{
+    dbbatch_t *batch = dbbatch_new();
+    dbbatch_delete(batch, key);
+
+    if (db_commit(batch)) {
+        twarnx("lmdb delete failed");
+    }
+
+    dbbatch_destroy(batch);
+}
+
+/* returns DB_FULL if the map has no room for the batch */
+int db_lmdb_write(dbbatch_t *batch)
 {
     MDB_txn *txn = NULL;
-    int r;
+    MDB_envinfo info;
+    MDB_dbi d;
+    MDB_val k, v;
+    uint64_t pos;
+    size_t i;
+    dbop_t *op;
+    lmdb_qdb_t *q;
+    int r, append;
+    uv_mutex_lock(&write_lock);
     r = mdb_txn_begin(env, NULL, 0, &txn);
 
     if (r) {
-        goto error;
+        uv_mutex_unlock(&write_lock);
+        twarnx("mdb_txn_begin failed: %s", mdb_strerror(r));
+        return -1;
     }
 
-    MDB_val k;
-    k.mv_size = key->len;
-    k.mv_data = key->data;
-    r = mdb_del(txn, dbi, &k, NULL);
+    for (i = 0; i < batch->nops; i++) {
+        op = &batch->ops[i];
+        r = db_lmdb_route(txn, dbbatch_key(batch, op), op->key_length, op->type == dbop_put, &d, &k, &pos, &q);
+
+        if (r == MDB_NOTFOUND && op->type != dbop_put) {
+            /* a queue without a database has nothing to delete */
+            continue;
+        }
+
+        if (!r && q && q->end == LMDB_END_UNKNOWN) {
+            r = db_lmdb_qdb_end(txn, q);
+        }
+
+        if (r) {
+            goto error;
+        }
+
+        if (op->type == dbop_put) {
+            v.mv_size = op->val_length;
+            v.mv_data = dbbatch_val(batch, op);
+            append = q && pos >= q->end;
+            r = mdb_put(txn, d, &k, &v, append ? MDB_APPEND : 0);
+
+            if (r == MDB_KEYEXIST) {
+                /* should the end be off, the put still goes in */
+                r = mdb_put(txn, d, &k, &v, 0);
+            }
+
+            if (!r && append) {
+                q->end = pos + 1;
+            }
+        }
+        else {
+            r = mdb_del(txn, d, &k, NULL);
+
+            if (r == MDB_NOTFOUND) {
+                r = 0;
+            }
+        }
+
+        if (r) {
+            goto error;
+        }
+    }
+
+    r = mdb_txn_commit(txn);
+    txn = NULL;
 
     if (r) {
         goto error;
     }
 
-    mdb_txn_commit(txn);
-    return;
+    db_lmdb_qdbs_settle(1);
+    uv_mutex_unlock(&write_lock);
+    return 0;
 error:
-    mdb_txn_abort(txn);
+
+    if (txn) {
+        mdb_txn_abort(txn);
+    }
+
+    db_lmdb_qdbs_settle(0);
+
+    if (r == MDB_MAP_FULL) {
+        mdb_env_info(env, &info);
+        full_mapsize = info.me_mapsize;
+        uv_mutex_unlock(&write_lock);
+        return DB_FULL;
+    }
+
+    uv_mutex_unlock(&write_lock);
+    twarnx("lmdb write failed: %s", mdb_strerror(r));
+    return -1;
+}
+
+/*
+ * Grow the map by lmdb_mapsize_step, up to lmdb_mapsize_max, after a write
+ * returned DB_FULL. Returns 0 if the write is worth retrying, -1 if not,
+ * and DB_FULL if pinned reads are in the way: the write is to be retried
+ * later, reads copy until then.
+ */
+int db_lmdb_grow()
+{
+    MDB_envinfo info;
+    size_t size, full;
+    int r = 0;
+    uv_mutex_lock(&readers_lock);
+    uv_mutex_lock(&write_lock);
+    mdb_env_info(env, &info);
+    full = full_mapsize;
+    uv_mutex_unlock(&write_lock);
+
+    if (info.me_mapsize > full) {
+        /* grown since that write */
+        uv_mutex_unlock(&readers_lock);
+        return 0;
+    }
+
+    if (info.me_mapsize >= conf->lmdb_mapsize_max) {
+        growing = 0;
+        uv_mutex_unlock(&readers_lock);
+        twarnx("lmdb map is full at lmdb_mapsize_max %zu", conf->lmdb_mapsize_max);
+        return -1;
+    }
+
+    if (readers_active) {
+        growing = 1;
+        uv_mutex_unlock(&readers_lock);
+        return DB_FULL;
+    }
+
+    size = info.me_mapsize + conf->lmdb_mapsize_step;
+
+    if (size > conf->lmdb_mapsize_max) {
+        size = conf->lmdb_mapsize_max;
+    }
+
+    uv_mutex_lock(&write_lock);
+
+    if ((r = mdb_env_set_mapsize(env, size))) {
+        twarnx("mdb_env_set_mapsize failed: %s", mdb_strerror(r));
+        r = -1;
+    }
+    else {
+        mdb_env_info(env, &info);
+
+        if (info.me_mapsize <= full) {
+            /* the write would only be full again */
+            twarnx("lmdb map did not grow past %zu", full);
+            r = -1;
+        }
+    }
+
+    uv_mutex_unlock(&write_lock);
+    growing = 0;
+    uv_mutex_unlock(&readers_lock);
+    return r;
+}
+
+/* whether pinned reads hold up growing the map */
+int db_lmdb_growing()
+{
+    int r;
+    uv_mutex_lock(&readers_lock);
+    r = growing;
+    uv_mutex_unlock(&readers_lock);
+    return r;
+}
+
+void db_lmdb_sync()
+{
+    int r = mdb_env_sync(env, 1);
+
+    if (r) {
+        twarnx("mdb_env_sync failed: %s", mdb_strerror(r));
+    }
 }
 
 void db_lmdb_close()
 {
+    lmdb_reader_t *reader;
+    lmdb_qdb_t *q;
+    size_t i;
+
+    for (i = 0; i < LMDB_QDB_TABLE_SIZE; i++) {
+        while ((q = qdbs[i])) {
+            qdbs[i] = q->next;
+            free(q);
+        }
+    }
+
+    while ((reader = readers)) {
+        readers = reader->next;
+        mdb_txn_abort(reader->txn);
+        free(reader);
+    }
+
+    readers_idle = 0;
     mdb_dbi_close(env, dbi);
     mdb_env_close(env);
 }
@@ -5,8 +5,16 @@
 
 void db_lmdb_init();
 dbi_t *db_lmdb_get(dbi_t *key);
+void db_lmdb_mget(dbi_t *keys, size_t n, dbi_t *items);
 void db_lmdb_put(dbi_t *key, dbi_t *val);
 void db_lmdb_delete(dbi_t *key);
+int db_lmdb_write(dbbatch_t *batch);
+int db_lmdb_iterate(dbi_t *start, db_iterate_cb cb, void *arg);
+void db_lmdb_sync();
 void db_lmdb_close();
+void db_lmdb_unpin(void *pin);
+int db_lmdb_grow();
+int db_lmdb_growing();
+int db_lmdb_admit(const char *name, size_t len);
 
 #endif
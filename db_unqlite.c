@@ -3,8 +3,15 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <alloca.h>
+#include <sys/stat.h>
 
 static unqlite *db = NULL;
+/* unqlite is not built thread safe, storage jobs and the loop thread share it */
+static uv_mutex_t lock;
+
+static int db_unqlite_apply(dbbatch_t *batch);
+static int db_unqlite_walk(db_iterate_cb cb, void *arg);
 
 void db_unqlite_init()
 {
@@ -25,17 +32,56 @@ void db_unqlite_init()
     if (rc != UNQLITE_OK) {
         terrx(1, "unable to open db at %s", path);
     }
+
+    uv_mutex_init(&lock);
 }
 
-dbi_t *db_unqlite_get(dbi_t *key)
+typedef struct {
+    dbi_t *item;
+    size_t size;
+} db_unqlite_value_t;
+
+/* unqlite hands a value over in one piece, or in several for large ones */
+static int db_unqlite_consume(const void *data, unsigned int len, void *arg)
 {
-    dbi_t *item = dbi_new();
-    unqlite_int64 len;
-    int rc = unqlite_kv_fetch(db, key->data, key->len, NULL, &len);
+    db_unqlite_value_t *value = arg;
+    dbi_t *item = value->item;
+
+    if (item->len + len > value->size) {
+        value->size = value->size ? value->size * 2 : len;
+
+        if (value->size < item->len + len) {
+            value->size = item->len + len;
+        }
+
+        item->data = realloc(item->data, value->size);
+        assert(item->data);
+    }
+
+    memcpy(item->data + item->len, data, len);
+    item->len += len;
+    return UNQLITE_OK;
+}
+
+/* one lookup that copies the value as it is found */
+static void db_unqlite_fetch(dbi_t *key, dbi_t *item)
+{
+    db_unqlite_value_t value;
+    int rc;
+    value.item = item;
+    value.size = 0;
+    item->data_is_malloced = 1;
+    rc = unqlite_kv_fetch_callback(db, key->data, key->len, db_unqlite_consume, &value);
 
     switch (rc) {
         case UNQLITE_OK:
-            break;
+            if (!item->data) {
+                /* an empty value */
+                item->data = malloc(1);
+                assert(item->data);
+            }
+
+            return;
 
         case UNQLITE_NOTFOUND:
             break;
@@ -57,34 +103,158 @@ dbi_t *db_unqlite_get(dbi_t *key)
             break;
     }
 
-    if (rc != UNQLITE_OK) {
-        return item;
-    }
+    free(item->data);
+    item->data = NULL;
+    item->len = 0;
+}
 
-    item->data = malloc(len);
-    assert(item->data);
-    item->data_is_malloced = 1;
-    unqlite_kv_fetch(db, key->data, key->len, item->data, &len);
-    item->len = (size_t)len;
+dbi_t *db_unqlite_get(dbi_t *key)
+{
+    dbi_t *item = dbi_new();
+    uv_mutex_lock(&lock);
+    db_unqlite_fetch(key, item);
+    uv_mutex_unlock(&lock);
+    return item;
+}
 
-    if (rc != UNQLITE_OK) {
-        item->err = strdup("unqlite_kv_fetch error");
+/* unqlite is a hash store, there is nothing better than a lookup per key */
+void db_unqlite_mget(dbi_t *keys, size_t n, dbi_t *items)
+{
+    size_t i;
+    uv_mutex_lock(&lock);
+
+    for (i = 0; i < n; i++) {
+        dbi_init(&items[i]);
+        db_unqlite_fetch(&keys[i], &items[i]);
     }
 
-    return item;
+    uv_mutex_unlock(&lock);
 }
 
 void db_unqlite_put(dbi_t *key, dbi_t *val)
 {
+    uv_mutex_lock(&lock);
     unqlite_kv_store(db, key->data, key->len, val->data, val->len);
+    uv_mutex_unlock(&lock);
 }
 
 void db_unqlite_delete(dbi_t *key)
 {
+    uv_mutex_lock(&lock);
     unqlite_kv_delete(db, key->data, key->len);
+    uv_mutex_unlock(&lock);
+}
+
+int db_unqlite_write(dbbatch_t *batch)
+{
+    int r;
+    uv_mutex_lock(&lock);
+    r = db_unqlite_apply(batch);
+    uv_mutex_unlock(&lock);
+    return r;
+}
+
+static int db_unqlite_apply(dbbatch_t *batch)
+{
+    size_t i;
+    dbop_t *op;
+    int rc = unqlite_begin(db);
+
+    if (rc != UNQLITE_OK) {
+        twarnx("unqlite_begin failed: %d", rc);
+        return -1;
+    }
+
+    for (i = 0; i < batch->nops; i++) {
+        op = &batch->ops[i];
+
+        if (op->type == dbop_put) {
+            rc = unqlite_kv_store(db, dbbatch_key(batch, op), op->key_length, dbbatch_val(batch, op), op->val_length);
+        }
+        else {
+            rc = unqlite_kv_delete(db, dbbatch_key(batch, op), op->key_length);
+
+            if (rc == UNQLITE_NOTFOUND) {
+                rc = UNQLITE_OK;
+            }
+        }
+
+        if (rc != UNQLITE_OK) {
+            twarnx("unqlite write failed: %d", rc);
+            unqlite_rollback(db);
+            return -1;
+        }
+    }
+
+    rc = unqlite_commit(db);
+
+    if (rc != UNQLITE_OK) {
+        twarnx("unqlite_commit failed: %d", rc);
+        unqlite_rollback(db);
+        return -1;
+    }
+
+    return 0;
+}
+
+int db_unqlite_iterate(dbi_t *start, db_iterate_cb cb, void *arg)
+{
+    int r;
+    (void)start;
+    uv_mutex_lock(&lock);
+    r = db_unqlite_walk(cb, arg);
+    uv_mutex_unlock(&lock);
+    return r;
+}
+
+/*
+ * Visit every key until cb returns non-zero. unqlite keeps keys in a hash,
+ * so the order is arbitrary and start is ignored. cb must not use the db.
+ */
+static int db_unqlite_walk(db_iterate_cb cb, void *arg)
+{
+    unqlite_kv_cursor *cursor;
+    unqlite_int64 vlen;
+    dbi_t k, v;
+    int klen, r = 0;
+    int rc = unqlite_kv_cursor_init(db, &cursor);
+
+    if (rc != UNQLITE_OK) {
+        twarnx("unqlite_kv_cursor_init failed: %d", rc);
+        return -1;
+    }
+
+    for (unqlite_kv_cursor_first_entry(cursor); unqlite_kv_cursor_valid_entry(cursor);
+         unqlite_kv_cursor_next_entry(cursor)) {
+        unqlite_kv_cursor_key(cursor, NULL, &klen);
+        unqlite_kv_cursor_data(cursor, NULL, &vlen);
+        k.data = malloc(klen ? klen : 1);
+        v.data = malloc(vlen ? vlen : 1);
+        assert(k.data && v.data);
+        unqlite_kv_cursor_key(cursor, k.data, &klen);
+        unqlite_kv_cursor_data(cursor, v.data, &vlen);
+        k.len = klen;
+        v.len = vlen;
+        r = cb(&k, &v, arg);
+        free(k.data);
+        free(v.data);
+
+        if (r) {
+            break;
+        }
+    }
+
+    unqlite_kv_cursor_release(db, cursor);
+    return r;
+}
+
+/* unqlite_commit syncs its journal and pages already, there is nothing left to flush */
+void db_unqlite_sync()
+{
 }
 
 void db_unqlite_close()
 {
     unqlite_close(db);
+    uv_mutex_destroy(&lock);
 }
@@ -3,8 +3,12 @@
 
 void db_unqlite_init();
 dbi_t *db_unqlite_get(dbi_t *key);
+void db_unqlite_mget(dbi_t *keys, size_t n, dbi_t *items);
 void db_unqlite_put(dbi_t *key, dbi_t *val);
 void db_unqlite_delete(dbi_t *key);
+int db_unqlite_write(dbbatch_t *batch);
+int db_unqlite_iterate(dbi_t *start, db_iterate_cb cb, void *arg);
+void db_unqlite_sync();
 void db_unqlite_close();
 
 #endif
@@ -0,0 +1,330 @@
+#include <string.h>
+#include <assert.h>
+#include <sys/time.h>
+#include "delay.h"
+#include "db.h"
+#include "key.h"
+#include "job.h"
+#include "loop.h"
+#include "conf.h"
+#include "queue.h"
+
+/*
+ * Delayed messages. A PUT with a delay writes its message under a delay
+ * key of the queue, which sorts by due time, and adds due time, sequence
+ * and queue to a min-heap of the loop that owns the queue. One timer is set
+ * for the top of the heap. When it fires, the due messages get the next
+ * positions of their queues and the storage job moves each value from its
+ * delay key to the item key of that position. The lane a message goes to
+ * is kept in the top bits of its sequence. Only the top of the heap is
+ * ever looked at, so it does not matter how many messages are waiting.
+ * The heap is rebuilt from the delay keys at startup. A purge of a queue
+ * drops its entries and deletes its delay keys in the batch of the purge.
+ */
+
+typedef struct {
+    uint64_t due;
+    uint64_t seq;
+    uint64_t size; /* of the message */
+    queue_t *queue;
+} delay_t;
+
+typedef struct {
+    dbbatch_t *found; /* delay keys of the queues of this loop */
+    char next[MAX_KEY_LENGTH]; /* where to go on from */
+    size_t next_length;
+} delay_scan_t;
+
+static __thread delay_t *heap = NULL;
+static __thread size_t heap_count = 0;
+static __thread size_t heap_size = 0;
+static __thread uv_timer_t delay_timer;
+static __thread delay_ready_cb delay_ready;
+
+/* unix time in ms, due times outlive the process */
+uint64_t delay_now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static int delay_before(delay_t *a, delay_t *b)
+{
+    return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+static void heap_push(uint64_t due, uint64_t seq, uint64_t size, queue_t *queue)
+{
+    size_t i, parent;
+    delay_t d;
+
+    if (heap_count == heap_size) {
+        heap_size = heap_size ? heap_size << 1 : 1024;
+        heap = realloc(heap, heap_size * sizeof(delay_t));
+        assert(heap);
+    }
+
+    d.due = due;
+    d.seq = seq;
+    d.size = size;
+    d.queue = queue;
+
+    for (i = heap_count++; i; i = parent) {
+        parent = (i - 1) / 2;
+
+        if (!delay_before(&d, &heap[parent])) {
+            break;
+        }
+
+        heap[i] = heap[parent];
+    }
+
+    heap[i] = d;
+}
+
+/* move the entry at i down to where it belongs */
+static void heap_down(size_t i)
+{
+    delay_t d = heap[i];
+    size_t child;
+
+    while ((child = 2 * i + 1) < heap_count) {
+        if (child + 1 < heap_count && delay_before(&heap[child + 1], &heap[child])) {
+            child++;
+        }
+
+        if (!delay_before(&heap[child], &d)) {
+            break;
+        }
+
+        heap[i] = heap[child];
+        i = child;
+    }
+
+    heap[i] = d;
+}
+
+static void heap_pop()
+{
+    heap[0] = heap[--heap_count];
+
+    if (heap_count) {
+        heap_down(0);
+    }
+}
+
+static void on_delay_timer(uv_timer_t *handle, int status);
+
+/* set the timer for the earliest due message */
+static void delay_schedule()
+{
+    uint64_t now;
+
+    if (!heap_count) {
+        uv_timer_stop(&delay_timer);
+        return;
+    }
+
+    now = delay_now();
+    uv_timer_start(&delay_timer, on_delay_timer, heap[0].due > now ? heap[0].due - now : 0, 0);
+}
+
+static void on_delay_timer(uv_timer_t *handle, int status)
+{
+    char from[MAX_KEY_LENGTH], to[MAX_KEY_LENGTH];
+    uint64_t now = delay_now();
+    size_t n = 0;
+    uint64_t size;
+    queue_t *queue;
+    int lane;
+    dbi_t f, t;
+    (void)handle;
+    (void)status;
+    f.data = from;
+    t.data = to;
+
+    while (heap_count && heap[0].due <= now && n++ < DELAY_MOVE_MAX) {
+        queue = heap[0].queue;
+        lane = LANE_OF(heap[0].seq);
+        size = heap[0].size;
+        f.len = key_delay(from, queue->name, queue->name_length, heap[0].due, heap[0].seq);
+        heap_pop();
+
+        if (queue->delayjob == job_serial()) {
+            /* the delay key is still in the open batch, the move has to come after it */
+            job_seal();
+        }
+
+        t.len = key_item(to, queue->name, queue->name_length, queue->lanes[lane].putpos);
+        job_move(&f, &t);
+        queue_put(queue, lane, 1, size);
+        queue->delayed--;
+        queue->exists = 1;
+        queue->dirty = 1;
+        queue_save(queue, batch);
+
+        if (queue->waiters) {
+            delay_ready(queue);
+        }
+    }
+
+    /* more than DELAY_MOVE_MAX due go on in the next loop iteration */
+    delay_schedule();
+}
+
+/* forget the delayed messages of a queue, it is being purged */
+void delay_purge(queue_t *queue)
+{
+    char buf[MAX_KEY_LENGTH];
+    size_t i, n = 0;
+    dbi_t key;
+
+    if (!queue->delayed) {
+        return;
+    }
+
+    key.data = buf;
+
+    for (i = 0; i < heap_count; i++) {
+        if (heap[i].queue == queue) {
+            key.len = key_delay(buf, queue->name, queue->name_length, heap[i].due, heap[i].seq);
+            dbbatch_delete(batch, &key);
+        }
+        else {
+            heap[n++] = heap[i];
+        }
+    }
+
+    heap_count = n;
+    i = n / 2;
+
+    while (i--) {
+        heap_down(i);
+    }
+
+    queue->delayed = 0;
+    delay_schedule();
+}
+
+/* a message for a lane of queue, to be delivered at due */
+void delay_put(queue_t *queue, int lane, uint64_t due, dbi_t *val)
+{
+    char buf[MAX_KEY_LENGTH];
+    uint64_t seq = LANE_BASE(lane) | queue->delayseq++;
+    dbi_t key;
+    key.data = buf;
+    key.len = key_delay(buf, queue->name, queue->name_length, due, seq);
+    dbbatch_put(batch, &key, val);
+    queue->delayed++;
+    queue->delayjob = job_serial();
+    heap_push(due, seq, val->len, queue);
+
+    if (heap[0].queue == queue && heap[0].seq == seq) {
+        delay_schedule();
+    }
+}
+
+/*
+ * Collect the delay keys of the queues this loop owns. On ordered engines
+ * the scan skips the other keys of each queue by starting over at the
+ * next place it wants to be; unqlite has no order and is walked whole.
+ */
+static int delay_scan(dbi_t *key, dbi_t *val, void *arg)
+{
+    delay_scan_t *scan = arg;
+    const char *name;
+    size_t name_length;
+    char buf[8];
+    int type, owned;
+    uint64_t due;
+    dbi_t size;
+
+    if (key_parse(key->data, key->len, &name, &name_length, &type, &due) < 0) {
+        return 0;
+    }
+
+    owned = loop_owner(name, name_length) == loop_self;
+
+    if (type == KEYTYPE_DELAY && owned) {
+        /* only the size of the message is kept until it is due */
+        uint64_encode(buf, val->len);
+        size.data = buf;
+        size.len = 8;
+        dbbatch_put(scan->found, key, &size);
+        return 0;
+    }
+
+    if (conf->engine == engine_unqlite) {
+        return 0;
+    }
+
+    /* to the delayed messages of the queue, or past the queue if there are none left or another loop owns it */
+    scan->next_length = key_prefix(scan->next, name, name_length, owned && type < KEYTYPE_DELAY ? KEYTYPE_DELAY : KEYTYPE_END);
+    return 1;
+}
+
+static void delay_load()
+{
+    char buf[MAX_KEY_LENGTH];
+    const char *key, *name;
+    size_t i, name_length;
+    int type, r;
+    uint64_t due, seq;
+    queue_t *queue;
+    delay_scan_t scan;
+    dbi_t from, *start = NULL;
+    dbop_t *op;
+    scan.found = dbbatch_new();
+    from.data = buf;
+
+    do {
+        scan.next_length = 0;
+
+        if ((r = db_iterate(start, delay_scan, &scan)) < 0) {
+            terrx(1, "unable to load delayed messages");
+        }
+
+        memcpy(buf, scan.next, scan.next_length);
+        from.len = scan.next_length;
+        start = &from;
+    }
+    while (r > 0);
+
+    for (i = 0; i < scan.found->nops; i++) {
+        op = &scan.found->ops[i];
+        key = dbbatch_key(scan.found, op);
+        key_parse(key, op->key_length, &name, &name_length, &type, &due);
+        seq = uint64_decode(key + name_length + 10);
+
+        if (queue_lookup(name, name_length, &queue) < 0) {
+            terrx(1, "unable to load queue %.*s", (int)name_length, name);
+        }
+
+        heap_push(due, seq, uint64_decode(dbbatch_val(scan.found, op)), queue);
+        queue->delayed++;
+
+        if ((seq & (LANE_BASE(1) - 1)) >= queue->delayseq) {
+            queue->delayseq = (seq & (LANE_BASE(1) - 1)) + 1;
+        }
+    }
+
+    dbbatch_destroy(scan.found);
+}
+
+void delay_init(uv_loop_t *loop, delay_ready_cb ready)
+{
+    delay_ready = ready;
+    heap_count = 0;
+    uv_timer_init(loop, &delay_timer);
+    delay_load();
+    delay_schedule();
+}
+
+void delay_destroy()
+{
+    uv_timer_stop(&delay_timer);
+    free(heap);
+    heap = NULL;
+    heap_count = heap_size = 0;
+}
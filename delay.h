@@ -0,0 +1,15 @@
+#ifndef _DELAY_H_
+#define _DELAY_H_
+
+#include "h.h"
+
+/* called when messages of a queue became due */
+typedef void (*delay_ready_cb)(queue_t *queue);
+
+uint64_t delay_now();
+void delay_init(uv_loop_t *loop, delay_ready_cb ready);
+void delay_put(queue_t *queue, int lane, uint64_t due, dbi_t *val);
+void delay_purge(queue_t *queue);
+void delay_destroy();
+
+#endif
@@ -0,0 +1,79 @@
+#include <string.h>
+#include <strings.h>
+#include "frame.h"
+
+/*
+ * Multi-message bodies.
+ *
+ * lines:  every line is a message, a trailing newline is optional.
+ * frames: every message is its decimal length, "\n", the data, "\n", so
+ *         messages may contain anything.
+ */
+
+format_t frame_format(const char *name, size_t len)
+{
+    if (len == 5 && !strncasecmp(name, "lines", 5)) {
+        return format_lines;
+    }
+
+    if (len == 6 && !strncasecmp(name, "frames", 6)) {
+        return format_frames;
+    }
+
+    return format_none;
+}
+
+/*
+ * Take the next message off *p.
+ * Returns 1 and advances *p if there is one, 0 at the end of the body and -1
+ * if the body is malformed.
+ */
+int frame_next(format_t format, const char **p, const char *end, const char **item, size_t *item_length)
+{
+    const char *s = *p;
+    size_t len = 0;
+
+    if (s >= end) {
+        return 0;
+    }
+
+    if (format == format_lines) {
+        const char *nl = memchr(s, '\n', end - s);
+        *item = s;
+        *item_length = nl ? (size_t)(nl - s) : (size_t)(end - s);
+        *p = nl ? nl + 1 : end;
+        return 1;
+    }
+
+    while (s < end && *s >= '0' && *s <= '9') {
+        len = len * 10 + (*s++ - '0');
+
+        /* no message is longer than the body, this also keeps len from overflowing */
+        if (len > (size_t)(end - *p)) {
+            return -1;
+        }
+    }
+
+    if (s == *p || s >= end || *s != '\n' || (size_t)(end - s - 1) < len + 1 || s[1 + len] != '\n') {
+        return -1;
+    }
+
+    *item = s + 1;
+    *item_length = len;
+    *p = s + 2 + len;
+    return 1;
+}
+
+/* returns the number of messages in body, or -1 if it is malformed */
+int frame_count(format_t format, const char *body, size_t len)
+{
+    const char *p = body, *end = body + len, *item;
+    size_t item_length;
+    int r, n = 0;
+
+    while ((r = frame_next(format, &p, end, &item, &item_length)) > 0) {
+        n++;
+    }
+
+    return r < 0 ? -1 : n;
+}
@@ -0,0 +1,10 @@
+#ifndef _FRAME_H_
+#define _FRAME_H_
+
+#include "h.h"
+
+format_t frame_format(const char *name, size_t len);
+int frame_next(format_t format, const char **p, const char *end, const char **item, size_t *item_length);
+int frame_count(format_t format, const char *body, size_t len);
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <err.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include "jemalloc/jemalloc.h"
 #include "http_parser.h"
 #include "uv.h"
@@ -11,12 +12,35 @@
 #define LEVELQ_VERSION "0.0.1"
 #define QUEUE_CHARS "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_."
 #define MAX_QNAME_LENGTH 200
-#define HEADER "HTTP/1.1 %d %s\r\n"\
-    "Server: levelq/"LEVELQ_VERSION"\r\n"\
+#define MAX_KEY_LENGTH 255
+#define MAX_GET_COUNT 1024
+#define RBUF_SIZE 65536
+#define RBUF_POOL_MAX 256
+#define REQUEST_ARENA_SIZE 4096
+#define REQUEST_POOL_MAX 1024
+#define MAX_GET_WAIT 60000 /* ms a GET may wait for a message */
+#define MAX_RESERVE 3600000 /* ms a reserved message may stay unacked */
+#define DELAY_MOVE_MAX 4096 /* due messages moved per timer run */
+#define WHEEL_TICK 10 /* ms */
+#define WHEEL_SLOTS 512 /* power of 2 */
+#define STREAM_WRITE_QUEUE_MAX 262144 /* bytes queued on a subscriber before reads pause */
+#define PINNED_WRITE_MAX 1000 /* ms a stalled write may hold pinned reads while the db waits to grow */
+#define QUEUE_LANES 4 /* priorities of a queue, 0 is the default and served last */
+#define LANE_SHIFT 56 /* positions of lane l start at l << LANE_SHIFT */
+#define LANE_BASE(lane) ((uint64_t)(lane) << LANE_SHIFT)
+#define LANE_OF(pos) ((int)((pos) >> LANE_SHIFT))
+#define RETAIN_INTERVAL 1000 /* ms between reaper runs */
+#define RETAIN_MARK 1000 /* ms of puts a retention mark stands for */
+#define RETAIN_MARKS_MAX 256 /* retention marks of a lane, every other one is dropped beyond */
+#define RETAIN_REAP_MAX 65536 /* messages dropped per reaper run */
+#define CACHE_SLOTS 256 /* newest messages of a lane the tail cache holds, power of 2 */
+#define RETAIN_SET_LENGTH 1 /* bits of request->retain */
+#define RETAIN_SET_BYTES 2
+#define RETAIN_SET_AGE 4
+#define HEADER_HEAD "Server: levelq/"LEVELQ_VERSION"\r\n"\
     "Content-Type: application/octet-stream\r\n"\
-    "Content-Length: %zu\r\n"\
-    "Connection: %s\r\n"\
-    "Cache-Control: no-store, no-cache, must-revalidate\r\n"\
+    "Content-Length: "
+#define HEADER_TAIL "Cache-Control: no-store, no-cache, must-revalidate\r\n"\
     "Pragma: no-cache\r\n"\
     "\r\n"
 
@@ -53,28 +77,290 @@
         } \
     } while (0)
 
-typedef struct {
+struct request_s;
+struct loop_s;
+
+/* a pooled read buffer, held by the read that fills it and the requests whose body is in it */
+typedef struct rbuf_s {
+    struct rbuf_s *next; /* in the free list of its loop */
+    struct loop_s *loop;
+    unsigned int refs;
+    char data[RBUF_SIZE];
+} rbuf_t;
+
+typedef struct client_s {
     uv_tcp_t handle;
     http_parser parser;
     unsigned short keepalive : 1;
+    unsigned short flush_queued : 1; /* in the flush list of its loop */
+    unsigned short stopped : 1; /* after a 413 or a stream, nothing more is parsed */
+    unsigned int refs; /* the handle plus every unfinished request */
+    int closed; /* the handle is closed, read by other loops with atomics */
+    struct loop_s *loop;
+    struct request_s *head; /* unanswered requests, in arrival order */
+    struct request_s **tail;
+    rbuf_t *rbuf; /* being parsed */
+    struct client_s *flush_next;
 } client_t;
 
+/* payloads of the newest messages of a lane, from position first on */
+typedef struct {
+    uint64_t first;
+    uint64_t count;
+    struct {
+        char *data; /* NULL if it was taken or did not fit */
+        size_t len;
+    } slots[CACHE_SLOTS];
+} cache_t;
+
+/* where a run of messages of a lane starts */
+typedef struct {
+    uint64_t pos;
+    uint64_t bytes; /* putbytes of the lane before pos */
+    uint64_t time; /* loop time pos was put at */
+} mark_t;
+
+/* positions of one priority of a queue */
 typedef struct {
+    uint64_t getpos;
+    uint64_t putpos;
+    uint64_t ackpos; /* messages before it are acked */
+    uint64_t bytes; /* of the messages from getpos on, as far as the marks tell */
+    uint64_t putbytes; /* bytes put since the lane was last empty */
+    uint64_t puttime; /* loop time of the last put */
+    cache_t *cache; /* NULL until something is cached */
+    mark_t *marks; /* from the run getpos is in on, oldest first */
+    size_t mark_first;
+    size_t mark_count;
+    size_t mark_size;
+    struct reservation_s *unacked; /* reserved messages not acked, by position */
+    struct reservation_s **unacked_tail;
+} lane_t;
+
+/* limits of a queue, 0 is none */
+typedef struct {
+    uint64_t max_length; /* messages */
+    uint64_t max_bytes;
+    uint64_t max_age; /* ms */
+} retention_t;
+
+typedef struct queue_s {
+    struct queue_s *next;
+    lane_t lanes[QUEUE_LANES];
+    unsigned int ready; /* bit per lane that has messages to get */
+    retention_t retention;
+    uint64_t delayed; /* messages not due yet */
+    uint64_t delayseq; /* tells apart delayed messages due at the same time */
+    uint64_t delayjob; /* job_serial of its last delayed PUT */
+    uint64_t savejob; /* job_serial of the last job that writes its state */
+    unsigned short exists : 1;
+    unsigned short dirty : 1; /* has items in the open batch */
+    unsigned short stale : 1; /* positions must be reloaded from db */
+    unsigned short reaping : 1; /* on the reaper list of its loop */
+    unsigned short admitted : 1; /* db_admit let it in */
+    struct queue_s *reap_next;
+    struct request_s *waiters; /* GETs waiting for a message, oldest first */
+    struct request_s **waiters_tail;
+    struct reservation_s *redeliver; /* unacked too long, to be reserved again, oldest first */
+    struct reservation_s **redeliver_tail;
+    size_t name_length;
+    char name[1];
+} queue_t;
+
+typedef enum {
+    format_none,
+    format_lines,
+    format_frames
+} format_t;
+
+typedef struct {
+    char *err;
+    char *data;
+    size_t len;
+    char data_is_malloced;
+    void *pin; /* what data points into, released by dbi_clear */
+} dbi_t;
+
+struct wheel_entry_s;
+
+typedef void (*wheel_cb)(struct wheel_entry_s *entry);
+
+/* a timeout in a timer wheel */
+typedef struct wheel_entry_s {
+    struct wheel_entry_s *next;
+    struct wheel_entry_s **pprev; /* NULL when not in a wheel */
+    uint64_t expires; /* tick */
+    wheel_cb cb;
+} wheel_entry_t;
+
+/* timeouts of a loop, WHEEL_TICK ms apart, all run off one uv timer */
+typedef struct {
+    uv_timer_t timer;
+    wheel_entry_t *slots[WHEEL_SLOTS];
+    uint64_t tick; /* last tick run */
+    size_t count;
+} wheel_t;
+
+/* a message handed out by GET ?reserve=, until it is acked */
+typedef struct reservation_s {
+    struct reservation_s *hash_next;
+    struct reservation_s *next; /* among the unacked of its lane */
+    struct reservation_s **pprev;
+    struct reservation_s *redeliver_next;
+    struct reservation_s **redeliver_pprev; /* NULL while reserved */
+    queue_t *queue;
+    uint64_t pos;
+    wheel_entry_t timeout; /* visible again once it fires */
+} reservation_t;
+
+/* allocations of one request, released together */
+typedef struct {
+    char *base;
+    size_t size;
+    size_t used;
+    void *blocks; /* what did not fit in base */
+    uint64_t mallocs; /* blocks allocated */
+} arena_t;
+
+/*
+ * GET ?subscribe=, kept by the loop of the connection. Plain fields, not
+ * bits, as the loop of the queue works on the request meanwhile.
+ */
+typedef struct {
+    uint64_t credit; /* messages in flight at most, 0 if not a stream */
+    uint64_t inflight; /* messages in writes not completed */
+    unsigned int writes; /* chunks being written */
+    int pulling; /* a read is out to the loop of the queue */
+    int started; /* response header written */
+    int ended; /* last chunk written, no more reads */
+} stream_t;
+
+typedef struct request_s {
     uv_write_t write_req;
     client_t *client;
+    struct loop_s *loop; /* the loop of the connection */
     char qname[200];
     size_t qname_length;
     enum http_method method;
     const char *body;
     size_t body_length;
+    format_t format; /* X-Batch, body holds several messages */
+    uint64_t count; /* ?n=, GET several messages */
+    uint64_t wait; /* ?wait=, ms a GET waits on an empty queue */
+    uint64_t reserve; /* ?reserve=, ms a GET hides its message until acked */
+    uint64_t pos; /* ?ack=, or the position GET ?reserve= handed out */
+    uint64_t due; /* ?delay= or ?at=, unix ms a PUT is delivered at */
+    uint64_t priority; /* ?priority=, lane a PUT goes to */
+    retention_t retention; /* ?max_length=, ?max_bytes=, ?max_age= of a POST */
+    char header_field[32];
+    size_t header_field_length;
+    char header_value[32];
+    size_t header_value_length;
+    rbuf_t *body_buf; /* holds body */
+    char *body_data; /* body gathered from several reads, when it does not fit a read buffer */
+    size_t body_size; /* what body_buf or body_data can take */
+    uint64_t body_expected; /* Content-Length, 0 if unknown */
+    unsigned short keepalive : 1;
+    unsigned short batched : 1; /* has writes in the open batch */
+    unsigned short ready : 1; /* reply can be written */
+    unsigned short ack : 1; /* has ?ack= */
+    unsigned short retain : 3; /* bits of the retention limits it has */
+    queue_t *queue;
+    dbi_t *keys; /* to read in the storage job */
+    size_t nkeys;
+    char *keybuf;
+    dbi_t *items; /* what was read */
+    void (*done)(struct request_s *request); /* formats the reply once read */
+    uv_buf_t *reply;
+    unsigned int nreply;
+    uv_buf_t reply_buf[2];
+    struct request_s *next; /* in a storage job, a loop inbox or a write */
+    struct request_s *client_next;
+    struct request_s *wait_next; /* among the waiters of queue */
+    struct request_s **wait_pprev;
+    wheel_entry_t timeout;
+    stream_t stream;
+    struct stream_chunk_s *chunk; /* read for the stream, to be written */
+    arena_t arena;
 } request_t;
 
+/* a chunk of a streamed response, owns its messages until it is written */
+typedef struct stream_chunk_s {
+    uv_write_t write_req;
+    request_t *request;
+    size_t n; /* messages */
+    unsigned short end : 1; /* last chunk of the response */
+    dbi_t *items;
+    uv_buf_t *bufs; /* bufs[0] is left for the response header */
+    unsigned int nbufs; /* after bufs[0] */
+    char *text; /* chunk size and length lines */
+} stream_chunk_t;
+
+/* an event loop thread with its own listener, queues and storage jobs */
+typedef struct loop_s {
+    unsigned int id;
+    uv_loop_t *loop;
+    uv_thread_t thread;
+    uv_tcp_t server;
+    uv_async_t async;
+    uv_mutex_t lock;
+    uv_check_t flush_check;
+    client_t *flush_head; /* clients with replies ready to write */
+    request_t *inbox; /* requests handed over by other loops */
+    request_t **inbox_tail;
+    rbuf_t *rbufs; /* idle read buffers */
+    size_t rbufs_idle;
+    uint64_t rbuf_hits;
+    uint64_t rbuf_misses;
+    request_t *requests; /* idle requests */
+    size_t requests_idle;
+    uint64_t request_hits;
+    uint64_t request_misses;
+    uint64_t arena_mallocs;
+    uint64_t cache_hits; /* messages a GET took from a tail cache */
+    uint64_t cache_misses; /* and the ones it read from db */
+    size_t cache_bytes; /* held by the tail caches of its queues */
+    wheel_t wheel;
+} loop_t;
+
+typedef enum {
+    status_ok,
+    status_bad_request,
+    status_not_found,
+    status_too_large,
+    status_error,
+    status_unavailable,
+    status_count
+} status_t;
+
+/* replies that never change, prebuilt by reply_init */
+typedef enum {
+    reply_ok,
+    reply_queue_not_exists,
+    reply_queue_empty,
+    reply_invalid_queue_name,
+    reply_invalid_method,
+    reply_invalid_batch,
+    reply_empty_batch,
+    reply_too_large,
+    reply_not_reserved,
+    reply_error,
+    reply_too_many_queues,
+    reply_count
+} reply_t;
+
 typedef enum {
     engine_leveldb,
     engine_lmdb,
     engine_unqlite
 } engine_t;
 
+typedef enum {
+    durability_none, /* left to the engine and the OS */
+    durability_interval, /* synced every durability_interval ms */
+    durability_always /* every commit is synced before it is acknowledged */
+} durability_t;
+
 typedef struct {
     engine_t engine;
     char *host;
@@ -83,26 +369,50 @@ typedef struct {
     unsigned int tcp_keepalive;
     unsigned int tcp_nodelay;
     unsigned int delete_after_get;
+    unsigned int group_commit_delay;
+    unsigned int group_commit_max;
+    unsigned int threads;
+    size_t max_message_size;
+    durability_t durability;
+    unsigned int durability_interval;
+    retention_t retention; /* of queues that have none of their own */
+    size_t cache_size; /* per loop, for the newest messages of its queues */
     /* leveldb only */
     size_t leveldb_cache_size;
     size_t leveldb_block_size;
     size_t leveldb_write_buffer_size;
     /* lmdb only */
     size_t lmdb_mapsize;
+    size_t lmdb_mapsize_step; /* grow the map by this much when it is full */
+    size_t lmdb_mapsize_max;
+    unsigned int lmdb_queue_dbs; /* a database per queue, at most this many queues */
 } conf_t;
 
+typedef enum {
+    dbop_put,
+    dbop_delete
+} dbop_type_t;
+
 typedef struct {
-    char *err;
-    char *data;
-    size_t len;
-    char data_is_malloced;
-} dbi_t;
+    dbop_type_t type;
+    size_t key_offset;
+    size_t key_length;
+    size_t val_offset;
+    size_t val_length;
+} dbop_t;
+
+/* a list of puts and deletes applied atomically by db_write */
+typedef struct {
+    dbop_t *ops;
+    size_t nops;
+    size_t ops_size;
+    char *buf;
+    size_t buf_length;
+    size_t buf_size;
+} dbbatch_t;
 
 
 extern conf_t conf[1];
 extern http_parser_settings parser_settings;
-extern uv_buf_t uvbuf[2];
-extern uv_loop_t *uv_loop;
-extern uv_tcp_t server;
 
 #endif
@@ -0,0 +1,534 @@
+#include <string.h>
+#include <assert.h>
+#include "job.h"
+#include "db.h"
+#include "queue.h"
+#include "key.h"
+
+/* how soon a write that had to wait for the map to grow is tried again */
+#define JOB_RETRY_MS 10
+
+/*
+ * Storage jobs.
+ *
+ * Requests that read or write the db are collected in the open job, whose
+ * batch is the one request handlers add their writes to. A sealed job runs
+ * on the libuv thread pool: first the reads of its requests, then one commit
+ * of its batch. Jobs run one at a time and in the order they were sealed,
+ * which keeps every queue's operations in order, and the loop thread keeps
+ * parsing and writing while the disk works. Requests are finished back on
+ * the loop thread.
+ *
+ * Writes that have no request of their own, like the deletes of the
+ * retention reaper, go in the batch the same way and count as writers.
+ *
+ * A job can also move values from one key to another, for messages whose
+ * delay is over: the value is read and rewritten by the job itself, so it
+ * never goes through the loop thread.
+ *
+ * A job that fails leaves the state of its queues on disk behind the one in
+ * memory, which is thrown away. Jobs sealed after it that write the state
+ * of any of those queues were built on what was thrown away, so they fail
+ * as well, and so on for the queues they write.
+ *
+ * The open job is sealed at the end of a loop iteration, or after
+ * group_commit_delay ms, or once it holds group_commit_max writers. While a
+ * job is running the open one keeps growing, so a slow disk gets bigger
+ * batches instead of a backlog.
+ */
+
+typedef struct job_s {
+    uv_work_t work;
+    dbbatch_t *batch;
+    dbbatch_t *moves; /* from key => to key, NULL if none */
+    request_t *head;
+    request_t **tail;
+    queue_t **queues; /* whose state it writes, each once */
+    size_t nqueues;
+    size_t queues_size;
+    unsigned int writers;
+    int failed;
+    struct job_s *next;
+} job_t;
+
+/* every loop thread runs its own jobs */
+__thread dbbatch_t *batch;
+
+static job_finish_cb job_finish;
+static __thread uv_loop_t *job_loop;
+static __thread job_t *open_job = NULL;
+static __thread job_t *sealed_head = NULL;
+static __thread job_t **sealed_tail = NULL;
+static __thread job_t *running = NULL;
+static __thread uint64_t open_serial = 1; /* 0 is before any job */
+static __thread uv_check_t job_check;
+static __thread uv_timer_t job_timer;
+static __thread uv_timer_t job_retry_timer;
+static __thread int stopping = 0; /* job_destroy runs what is left itself */
+
+static void job_after_work(uv_work_t *req, int status);
+static void on_job_retry_timer(uv_timer_t *handle, int status);
+
+/* whether a job has anything to do, writes without a request included */
+static int job_pending(job_t *job)
+{
+    return job->head || job->moves || job->batch->nops;
+}
+
+static job_t *job_new()
+{
+    job_t *job = malloc(sizeof(job_t));
+    assert(job);
+    job->work.data = job;
+    job->batch = dbbatch_new();
+    job->moves = NULL;
+    job->head = NULL;
+    job->tail = &job->head;
+    job->queues = NULL;
+    job->nqueues = 0;
+    job->queues_size = 0;
+    job->writers = 0;
+    job->failed = 0;
+    job->next = NULL;
+    return job;
+}
+
+static void job_free(job_t *job)
+{
+    dbbatch_destroy(job->batch);
+
+    if (job->moves) {
+        dbbatch_destroy(job->moves);
+    }
+
+    free(job->queues);
+    free(job);
+}
+
+typedef struct {
+    dbi_t key;
+    dbop_t *op;
+} move_t;
+
+static int move_compare(const void *a, const void *b)
+{
+    const dbi_t *x = &((const move_t *)a)->key, *y = &((const move_t *)b)->key;
+    return dbi_compare(x->data, x->len, y->data, y->len);
+}
+
+/* whether two keys are of the same queue */
+static int move_same_queue(dbi_t *a, dbi_t *b)
+{
+    const char *na, *nb;
+    size_t la, lb;
+    uint64_t pos;
+    int type;
+
+    if (key_parse(a->data, a->len, &na, &la, &type, &pos) || key_parse(b->data, b->len, &nb, &lb, &type, &pos)) {
+        return 0;
+    }
+
+    return la == lb && !memcmp(na, nb, la);
+}
+
+/*
+ * Add the moves of a job to its batch: a put of each value to its new key
+ * and a delete of the old one. The moves of several queues come in the
+ * order they were due, they are read in key order and one queue at a time,
+ * so no read walks over the items of the queues in between. A value that
+ * cannot be read fails the job, its queue already counts the message.
+ */
+static void job_apply_moves(job_t *job)
+{
+    size_t i, j, n = job->moves->nops;
+    move_t *moves = malloc(n * sizeof(move_t));
+    dbi_t *keys = malloc(2 * n * sizeof(dbi_t)), *items = keys + n, to;
+    dbop_t *op;
+    assert(moves && keys);
+
+    for (i = 0; i < n; i++) {
+        op = &job->moves->ops[i];
+        moves[i].key.data = dbbatch_key(job->moves, op);
+        moves[i].key.len = op->key_length;
+        moves[i].op = op;
+    }
+
+    qsort(moves, n, sizeof(move_t), move_compare);
+
+    for (i = 0; i < n; i++) {
+        keys[i] = moves[i].key;
+        dbi_init(&items[i]);
+    }
+
+    for (i = 0; i < n; i = j) {
+        j = i + 1;
+
+        while (j < n && move_same_queue(&keys[i], &keys[j])) {
+            j++;
+        }
+
+        db_mget(keys + i, j - i, items + i);
+    }
+
+    for (i = 0; i < n; i++) {
+        op = moves[i].op;
+
+        if (items[i].err) {
+            twarnx("%s", items[i].err);
+            job->failed = -1;
+        }
+        else if (!items[i].data) {
+            twarnx("delayed message to move is missing");
+            job->failed = -1;
+        }
+        else if (!job->failed) {
+            to.data = dbbatch_val(job->moves, op);
+            to.len = op->val_length;
+            dbbatch_put(job->batch, &to, &items[i]);
+            dbbatch_delete(job->batch, &keys[i]);
+        }
+
+        dbi_clear(&items[i]);
+    }
+
+    free(keys);
+    free(moves);
+    /* a job that is run again must not move them twice */
+    dbbatch_destroy(job->moves);
+    job->moves = NULL;
+}
+
+/* read the items of a request the tail cache did not fill in, in runs */
+static void job_read(request_t *request)
+{
+    size_t i = 0, j;
+
+    while (i < request->nkeys) {
+        if (request->items[i].data) {
+            i++;
+            continue;
+        }
+
+        j = i + 1;
+
+        /* the engines read a run forwards, every lane of a GET is a run of its own */
+        while (j < request->nkeys && !request->items[j].data
+               && dbi_compare(request->keys[j - 1].data, request->keys[j - 1].len,
+                              request->keys[j].data, request->keys[j].len) < 0) {
+            j++;
+        }
+
+        db_mget(request->keys + i, j - i, request->items + i);
+        i = j;
+    }
+}
+
+/* runs on a thread pool thread */
+static void job_work(uv_work_t *req)
+{
+    job_t *job = (job_t *)req->data;
+    request_t *request;
+    size_t i;
+
+    for (request = job->head; request; request = request->next) {
+        if (!job->failed || !request->batched) {
+            job_read(request);
+        }
+    }
+
+    /* failed before it ran, because one before it did */
+    if (job->failed) {
+        return;
+    }
+
+    if (job->moves) {
+        job_apply_moves(job);
+    }
+
+    if (job->failed) {
+        return;
+    }
+
+    if (job->batch->nops) {
+        job->failed = db_write(job->batch);
+
+        if (job->failed == DB_FULL) {
+            /* growing needs every pinned read to be done, ours first */
+            for (request = job->head; request; request = request->next) {
+                for (i = 0; i < request->nkeys; i++) {
+                    dbi_detach(&request->items[i]);
+                }
+            }
+        }
+
+        /* DB_FULL is left if pins of others are still in the way */
+        while (job->failed == DB_FULL && !(job->failed = db_grow())) {
+            job->failed = db_write(job->batch);
+        }
+    }
+}
+
+static void job_run_next()
+{
+    int r;
+
+    if (stopping || running || !sealed_head || uv_is_active((uv_handle_t *)&job_retry_timer)) {
+        return;
+    }
+
+    running = sealed_head;
+    sealed_head = running->next;
+
+    if (!sealed_head) {
+        sealed_tail = &sealed_head;
+    }
+
+    r = uv_queue_work(job_loop, &running->work, job_work, job_after_work);
+    uv_assert(r, "uv_queue_work");
+}
+
+static void job_invalidate(job_t *job)
+{
+    size_t i;
+
+    for (i = 0; i < job->nqueues; i++) {
+        queue_invalidate(job->queues[i]);
+    }
+}
+
+static int job_stale(job_t *job)
+{
+    size_t i;
+
+    for (i = 0; i < job->nqueues; i++) {
+        if (job->queues[i]->stale) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* fail the jobs that come after a failed one and write any queue it left stale */
+static void job_fail_after(job_t *failed)
+{
+    job_t *job;
+    job_invalidate(failed);
+
+    for (job = sealed_head; job; job = job->next) {
+        if (!job->failed && job_stale(job)) {
+            job->failed = -1;
+            job_invalidate(job);
+        }
+    }
+
+    if (job_stale(open_job)) {
+        /* what is added from now on is built on reloaded state */
+        open_job->failed = -1;
+        job_invalidate(open_job);
+        job_seal();
+    }
+}
+
+static void job_after_work(uv_work_t *req, int status)
+{
+    job_t *job = (job_t *)req->data;
+    request_t *request, *next;
+    uv_check(status, "job");
+    running = NULL;
+
+    if (job->failed == DB_FULL && !status) {
+        /* pinned reads of other requests keep the map from growing, until their replies are written */
+        job->failed = 0;
+        job->next = sealed_head;
+        sealed_head = job;
+
+        if (!job->next) {
+            sealed_tail = &job->next;
+        }
+
+        uv_timer_start(&job_retry_timer, on_job_retry_timer, JOB_RETRY_MS, 0);
+        return;
+    }
+
+    if (job->failed || status) {
+        job_fail_after(job);
+    }
+
+    for (request = job->head; request; request = next) {
+        next = request->next;
+        job_finish(request, request->batched && (job->failed || status));
+    }
+
+    job_free(job);
+
+    if (!sealed_head && job_pending(open_job) && !conf->group_commit_delay) {
+        job_seal();
+    }
+
+    job_run_next();
+}
+
+static void on_job_check(uv_check_t *handle, int status)
+{
+    (void)handle;
+    (void)status;
+
+    if (!conf->group_commit_delay && job_pending(open_job) && !running && !sealed_head) {
+        job_seal();
+    }
+}
+
+static void on_job_timer(uv_timer_t *handle, int status)
+{
+    (void)handle;
+    (void)status;
+    job_seal();
+}
+
+static void on_job_retry_timer(uv_timer_t *handle, int status)
+{
+    (void)handle;
+    (void)status;
+    job_run_next();
+}
+
+void job_init(uv_loop_t *loop, job_finish_cb finish)
+{
+    job_loop = loop;
+    job_finish = finish;
+    sealed_tail = &sealed_head;
+    open_job = job_new();
+    batch = open_job->batch;
+    uv_check_init(loop, &job_check);
+    uv_check_start(&job_check, on_job_check);
+    uv_timer_init(loop, &job_timer);
+    uv_timer_init(loop, &job_retry_timer);
+}
+
+/* one more write in the open job, which may be enough to seal it */
+void job_write()
+{
+    if (++open_job->writers >= conf->group_commit_max) {
+        job_seal();
+    }
+    else if (conf->group_commit_delay && !uv_is_active((uv_handle_t *)&job_timer)) {
+        uv_timer_start(&job_timer, on_job_timer, conf->group_commit_delay, 0);
+    }
+}
+
+/* add a request to the open job, it is finished once the job has run */
+void job_add(request_t *request)
+{
+    *open_job->tail = request;
+    open_job->tail = &request->next;
+    request->next = NULL;
+
+    if (request->batched) {
+        job_write();
+    }
+}
+
+/* have the open job move the value of key from to key to */
+void job_move(dbi_t *from, dbi_t *to)
+{
+    if (!open_job->moves) {
+        open_job->moves = dbbatch_new();
+    }
+
+    dbbatch_put(open_job->moves, from, to);
+    job_write();
+}
+
+/* the open job writes the state of queue, which is thrown away if it fails */
+void job_queue(queue_t *queue)
+{
+    job_t *job = open_job;
+
+    if (queue->savejob == open_serial) {
+        return;
+    }
+
+    queue->savejob = open_serial;
+
+    if (job->nqueues == job->queues_size) {
+        job->queues_size = job->queues_size ? job->queues_size << 1 : 8;
+        job->queues = realloc(job->queues, job->queues_size * sizeof(queue_t *));
+        assert(job->queues);
+    }
+
+    job->queues[job->nqueues++] = queue;
+}
+
+/* close the open job and queue it to run */
+void job_seal()
+{
+    request_t *request;
+
+    if (!job_pending(open_job)) {
+        return;
+    }
+
+    /* items written so far are no longer in the open batch */
+    for (request = open_job->head; request; request = request->next) {
+        if (request->queue) {
+            request->queue->dirty = 0;
+        }
+    }
+
+    *sealed_tail = open_job;
+    sealed_tail = &open_job->next;
+    open_job = job_new();
+    open_serial++;
+    batch = open_job->batch;
+    uv_timer_stop(&job_timer);
+    job_run_next();
+}
+
+/* tells the open job apart from the ones before it */
+uint64_t job_serial()
+{
+    return open_serial;
+}
+
+/*
+ * After the loop has stopped: let the running job finish, run the rest on
+ * this thread and answer their requests, then write the replies.
+ */
+void job_destroy()
+{
+    job_t *job;
+    stopping = 1;
+
+    while (running) {
+        uv_run(job_loop, UV_RUN_ONCE);
+    }
+
+    /* a job the map was full for is back in sealed_head, it is run below */
+    uv_check_stop(&job_check);
+    uv_timer_stop(&job_timer);
+    uv_timer_stop(&job_retry_timer);
+
+    /* finishing requests can write again */
+    for (job_seal(); (job = sealed_head); job_seal()) {
+        sealed_head = job->next;
+
+        if (!sealed_head) {
+            sealed_tail = &sealed_head;
+        }
+
+        job_work(&job->work);
+
+        if (job->failed == DB_FULL) {
+            /* nothing is left to unpin the map */
+            job->failed = -1;
+        }
+
+        job_after_work(&job->work, 0);
+    }
+
+    uv_run(job_loop, UV_RUN_NOWAIT);
+    job_free(open_job);
+    open_job = NULL;
+    batch = NULL;
+}
@@ -0,0 +1,20 @@
+#ifndef _JOB_H_
+#define _JOB_H_
+
+#include "h.h"
+
+/* called on the loop thread for every request of a finished job, in order */
+typedef void (*job_finish_cb)(request_t *request, int failed);
+
+extern __thread dbbatch_t *batch;
+
+void job_init(uv_loop_t *loop, job_finish_cb finish);
+void job_add(request_t *request);
+void job_move(dbi_t *from, dbi_t *to);
+void job_queue(queue_t *queue);
+void job_write();
+void job_seal();
+uint64_t job_serial();
+void job_destroy();
+
+#endif
@@ -0,0 +1,192 @@
+#include <string.h>
+#include "key.h"
+
+void uint64_encode(char *buf, uint64_t v)
+{
+    int i;
+
+    for (i = 7; i >= 0; i--) {
+        buf[i] = (char)(v & 0xff);
+        v >>= 8;
+    }
+}
+
+uint64_t uint64_decode(const char *buf)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        v = (v << 8) | (unsigned char)buf[i];
+    }
+
+    return v;
+}
+
+size_t key_meta(char *buf, const char *name, size_t len)
+{
+    buf[0] = (char)len;
+    memcpy(buf + 1, name, len);
+    buf[1 + len] = KEYTYPE_META;
+    return len + 2;
+}
+
+size_t key_item(char *buf, const char *name, size_t len, uint64_t pos)
+{
+    buf[0] = (char)len;
+    memcpy(buf + 1, name, len);
+    buf[1 + len] = KEYTYPE_ITEM;
+    uint64_encode(buf + 2 + len, pos);
+    return len + 10;
+}
+
+size_t key_delay(char *buf, const char *name, size_t len, uint64_t due, uint64_t seq)
+{
+    buf[0] = (char)len;
+    memcpy(buf + 1, name, len);
+    buf[1 + len] = KEYTYPE_DELAY;
+    uint64_encode(buf + 2 + len, due);
+    uint64_encode(buf + 10 + len, seq);
+    return len + 18;
+}
+
+size_t key_retention(char *buf, const char *name, size_t len)
+{
+    buf[0] = (char)len;
+    memcpy(buf + 1, name, len);
+    buf[1 + len] = KEYTYPE_RETENTION;
+    return len + 2;
+}
+
+/* where the keys of a type of a queue start */
+size_t key_prefix(char *buf, const char *name, size_t len, int type)
+{
+    buf[0] = (char)len;
+    memcpy(buf + 1, name, len);
+    buf[1 + len] = (char)type;
+    return len + 2;
+}
+
+/* the format version lives at the meta key of the empty queue name */
+size_t key_version(char *buf)
+{
+    return key_meta(buf, "", 0);
+}
+
+/* returns 0 and fills in the parts of a key, -1 if it is not a valid key */
+int key_parse(const char *key, size_t keylen, const char **name, size_t *name_length, int *type, uint64_t *pos)
+{
+    size_t len;
+
+    if (keylen < 2) {
+        return -1;
+    }
+
+    len = (unsigned char)key[0];
+
+    if (keylen < len + 2) {
+        return -1;
+    }
+
+    *name = key + 1;
+    *name_length = len;
+    *type = key[1 + len];
+
+    switch (*type) {
+        case KEYTYPE_META:
+        case KEYTYPE_RETENTION:
+            if (keylen != len + 2) {
+                return -1;
+            }
+
+            *pos = 0;
+            return 0;
+
+        case KEYTYPE_ITEM:
+            if (keylen != len + 10) {
+                return -1;
+            }
+
+            *pos = uint64_decode(key + 2 + len);
+            return 0;
+
+        case KEYTYPE_DELAY:
+            /* pos is the due time, the sequence follows it */
+            if (keylen != len + 18) {
+                return -1;
+            }
+
+            *pos = uint64_decode(key + 2 + len);
+            return 0;
+
+        default:
+            return -1;
+    }
+}
+
+/* keys written by version 1 only hold queue name characters and ':' */
+int key_is_text(const char *key, size_t keylen)
+{
+    size_t i;
+
+    for (i = 0; i < keylen; i++) {
+        if (key[i] != ':' && (!key[i] || !strchr(QUEUE_CHARS, key[i]))) {
+            return 0;
+        }
+    }
+
+    return keylen > 0;
+}
+
+/* returns the length of the value, lanes past the last used one are left out */
+size_t meta_encode(char *buf, const lane_t *lanes)
+{
+    int i, n = 1;
+
+    for (i = 1; i < QUEUE_LANES; i++) {
+        if (lanes[i].putpos != LANE_BASE(i)) {
+            n = i + 1;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        uint64_encode(buf, lanes[i].getpos);
+        uint64_encode(buf + 8, lanes[i].putpos);
+        uint64_encode(buf + 16, lanes[i].ackpos);
+        uint64_encode(buf + 24, lanes[i].bytes);
+        buf += META_LENGTH;
+    }
+
+    return n * META_LENGTH;
+}
+
+/* returns -1 if buf is too short to be a meta value */
+int meta_decode(const char *buf, size_t len, lane_t *lanes)
+{
+    int i;
+
+    if (len < META_MIN_LENGTH) {
+        return -1;
+    }
+
+    lanes[0].getpos = uint64_decode(buf);
+    lanes[0].putpos = uint64_decode(buf + 8);
+    lanes[0].ackpos = len < META_ACK_LENGTH ? lanes[0].getpos : uint64_decode(buf + 16);
+    lanes[0].bytes = len < META_LENGTH ? 0 : uint64_decode(buf + 24);
+
+    for (i = 1; i < QUEUE_LANES; i++) {
+        if (len >= (size_t)(i + 1) * META_LENGTH) {
+            buf += META_LENGTH;
+            lanes[i].getpos = uint64_decode(buf);
+            lanes[i].putpos = uint64_decode(buf + 8);
+            lanes[i].ackpos = uint64_decode(buf + 16);
+            lanes[i].bytes = uint64_decode(buf + 24);
+        }
+        else {
+            lanes[i].getpos = lanes[i].putpos = lanes[i].ackpos = LANE_BASE(i);
+            lanes[i].bytes = 0;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef _KEY_H_
+#define _KEY_H_
+
+#include "h.h"
+
+/*
+ * On-disk key layout, version 2:
+ *
+ *   meta:  [name length][name][KEYTYPE_META]
+ *   item:  [name length][name][KEYTYPE_ITEM][position, 64 bit big endian]
+ *   delay: [name length][name][KEYTYPE_DELAY][due, unix ms][sequence], 64 bit big endian each
+ *   retention: [name length][name][KEYTYPE_RETENTION]
+ *
+ * so all keys of a queue are adjacent, its items sort by position and its
+ * delayed messages by the time they are due.
+ * The meta value is getpos, putpos, ackpos and the bytes of the messages
+ * from getpos on, 64 bit big endian each, for every priority lane up to
+ * the highest one ever used. Positions of lane l start at l << LANE_SHIFT,
+ * so lane 0 is what a queue was before it had lanes, and lanes missing
+ * from the value are empty. ackpos, the oldest message not acked, and the
+ * bytes were added later; meta values without them read as ackpos =
+ * getpos and 0 bytes. The retention value is max_length, max_bytes and
+ * max_age of a queue that has limits of its own. Version 1 was "name" =>
+ * "getpos,putpos" and "name:pos" => item, as text.
+ */
+
+#define KEY_FORMAT_VERSION 2
+#define KEYTYPE_META 0
+#define KEYTYPE_ITEM 1
+#define KEYTYPE_DELAY 2
+#define KEYTYPE_RETENTION 3
+#define KEYTYPE_END 0xff /* past every key of a queue */
+#define META_LENGTH 32 /* of one lane */
+#define META_ACK_LENGTH 24 /* without bytes */
+#define META_MIN_LENGTH 16 /* without ackpos */
+#define META_MAX_LENGTH (META_LENGTH * QUEUE_LANES)
+#define RETENTION_LENGTH 24
+
+size_t key_meta(char *buf, const char *name, size_t len);
+size_t key_item(char *buf, const char *name, size_t len, uint64_t pos);
+size_t key_delay(char *buf, const char *name, size_t len, uint64_t due, uint64_t seq);
+size_t key_retention(char *buf, const char *name, size_t len);
+size_t key_prefix(char *buf, const char *name, size_t len, int type);
+size_t key_version(char *buf);
+int key_parse(const char *key, size_t keylen, const char **name, size_t *name_length, int *type, uint64_t *pos);
+int key_is_text(const char *key, size_t keylen);
+
+size_t meta_encode(char *buf, const lane_t *lanes);
+int meta_decode(const char *buf, size_t len, lane_t *lanes);
+
+void uint64_encode(char *buf, uint64_t v);
+uint64_t uint64_decode(const char *buf);
+
+#endif
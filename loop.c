@@ -0,0 +1,118 @@
+#include <assert.h>
+#include "loop.h"
+#include "queue.h"
+
+/*
+ * Event loop threads.
+ *
+ * Every loop accepts connections on its own listener and owns the queues
+ * whose name hashes to it: positions, the position cache and storage jobs
+ * of a queue are only ever touched by its owner, so they need no locks and
+ * updates stay serialized. A request for a queue owned by another loop is
+ * handed over through that loop's inbox, and handed back the same way once
+ * its reply is ready, so only the connection's loop writes to its socket.
+ */
+
+loop_t *loops = NULL;
+unsigned int nloops = 0;
+__thread loop_t *loop_self = NULL;
+
+static loop_request_cb loop_handler;
+static loop_setup_cb loop_setup;
+static loop_setup_cb loop_teardown;
+
+static void on_loop_async(uv_async_t *handle, int status)
+{
+    loop_t *loop = container_of(handle, loop_t, async);
+    request_t *request, *next;
+    (void)status;
+    uv_mutex_lock(&loop->lock);
+    request = loop->inbox;
+    loop->inbox = NULL;
+    loop->inbox_tail = &loop->inbox;
+    uv_mutex_unlock(&loop->lock);
+
+    for (; request; request = next) {
+        next = request->next;
+        request->next = NULL;
+        loop_handler(request);
+    }
+}
+
+/* handler is called on the receiving loop for every request posted to it */
+void loop_init(unsigned int n, loop_request_cb handler)
+{
+    unsigned int i;
+    loop_handler = handler;
+    nloops = n ? n : 1;
+    loops = calloc(nloops, sizeof(loop_t));
+    assert(loops);
+
+    for (i = 0; i < nloops; i++) {
+        loop_t *loop = &loops[i];
+        loop->id = i;
+        loop->loop = i ? uv_loop_new() : uv_default_loop();
+        assert(loop->loop);
+        loop->inbox = NULL;
+        loop->inbox_tail = &loop->inbox;
+        uv_mutex_init(&loop->lock);
+        /* before any loop runs, so posting to a loop that is still starting is safe */
+        uv_async_init(loop->loop, &loop->async, on_loop_async);
+    }
+}
+
+static void loop_thread(void *arg)
+{
+    loop_t *loop = arg;
+    loop_self = loop;
+    loop_setup(loop);
+    uv_run(loop->loop, UV_RUN_DEFAULT);
+    loop_teardown(loop);
+}
+
+/*
+ * Run every loop, the first one on the calling thread. setup and teardown
+ * are called on the thread of each loop, before and after it runs.
+ */
+void loop_run(loop_setup_cb setup, loop_setup_cb teardown)
+{
+    unsigned int i;
+    int r;
+    loop_setup = setup;
+    loop_teardown = teardown;
+
+    for (i = 1; i < nloops; i++) {
+        r = uv_thread_create(&loops[i].thread, loop_thread, &loops[i]);
+        uv_assert(r, "uv_thread_create");
+    }
+
+    loop_thread(&loops[0]);
+
+    for (i = 1; i < nloops; i++) {
+        uv_thread_join(&loops[i].thread);
+    }
+}
+
+void loop_post(loop_t *loop, request_t *request)
+{
+    request->next = NULL;
+    uv_mutex_lock(&loop->lock);
+    *loop->inbox_tail = request;
+    loop->inbox_tail = &request->next;
+    uv_mutex_unlock(&loop->lock);
+    uv_async_send(&loop->async);
+}
+
+loop_t *loop_owner(const char *name, size_t len)
+{
+    return &loops[queue_hash(name, len) % nloops];
+}
+
+void loop_stop()
+{
+    unsigned int i;
+
+    for (i = 0; i < nloops; i++) {
+        uv_stop(loops[i].loop);
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef _LOOP_H_
+#define _LOOP_H_
+
+#include "h.h"
+
+typedef void (*loop_setup_cb)(loop_t *loop);
+typedef void (*loop_request_cb)(request_t *request);
+
+extern loop_t *loops;
+extern unsigned int nloops;
+extern __thread loop_t *loop_self;
+
+void loop_init(unsigned int n, loop_request_cb handler);
+void loop_run(loop_setup_cb setup, loop_setup_cb teardown);
+void loop_post(loop_t *loop, request_t *request);
+loop_t *loop_owner(const char *name, size_t len);
+void loop_stop();
+
+#endif
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <inttypes.h>
@@ -8,52 +9,138 @@
 #include <err.h>
 #include <sys/stat.h>
 #include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 #include "h.h"
 #include "db.h"
-#include "db_lmdb.h"
-#include "db_leveldb.h"
-#include "db_unqlite.h"
+#include "key.h"
 #include "conf.h"
+#include "queue.h"
+#include "frame.h"
+#include "job.h"
+#include "loop.h"
+#include "rbuf.h"
+#include "arena.h"
+#include "reply.h"
+#include "wheel.h"
+#include "reserve.h"
+#include "delay.h"
+#include "retain.h"
+#include "cache.h"
 
 typedef struct {
-    dbi_t *item;
     char buf[1];
 } repbuf_t;
 
-repbuf_t *repbuf_new(size_t size)
+http_parser_settings parser_settings;
+
+/* durability = interval, driven by the first loop */
+static uv_timer_t sync_timer;
+static uv_work_t sync_work;
+static int sync_running = 0;
+
+void request_free(request_t *request);
+int request_too_large(request_t *request);
+void stream_flush(request_t *request);
+void stream_end(request_t *request);
+
+void client_release(client_t *client)
 {
-    repbuf_t *repbuf = malloc(sizeof(repbuf_t) + size);
-    assert(repbuf);
-    repbuf->item = NULL;
-    return repbuf;
+    if (--client->refs == 0) {
+        free(client);
+    }
 }
 
-void repbuf_free(repbuf_t *repbuf)
+void on_close(uv_handle_t *handle)
 {
-    if (repbuf) {
-        dbi_destroy(repbuf->item);
-        free(repbuf);
+    client_t *client = (client_t *)handle->data;
+    request_t *request;
+
+    if (client->parser.data != client) {
+        /* closed in the middle of a request, it holds the client and maybe a read buffer */
+        request = client->parser.data;
+        client->parser.data = client;
+        request_free(request);
     }
+
+    __sync_fetch_and_or(&client->closed, 1);
+    client_release(client);
 }
 
-uv_loop_t *uv_loop;
-uv_tcp_t server;
-http_parser_settings parser_settings;
-uv_buf_t uvbuf[2];
+/* whether the connection of a request is gone, asked on any loop */
+int request_closed(request_t *request)
+{
+    client_t *client = request->client;
 
-void on_close(uv_handle_t *handle)
+    if (request->loop == loop_self) {
+        return uv_is_closing((uv_handle_t *)&client->handle);
+    }
+
+    return __sync_fetch_and_or(&client->closed, 0);
+}
+
+/* a request from the pool of the loop, or a new one */
+request_t *request_new(loop_t *loop)
 {
-    client_t *client = (client_t *)handle->data;
-    free(client);
+    request_t *request = loop->requests;
+
+    if (request) {
+        loop->requests = request->next;
+        loop->requests_idle--;
+        loop->request_hits++;
+        return request;
+    }
+
+    request = malloc(sizeof(request_t));
+    assert(request);
+    arena_init(&request->arena, REQUEST_ARENA_SIZE);
+    loop->request_misses++;
+    return request;
+}
+
+void request_free(request_t *request)
+{
+    client_t *client = request->client;
+    loop_t *loop = request->loop;
+    size_t i;
+
+    for (i = 0; i < request->nkeys; i++) {
+        dbi_clear(&request->items[i]);
+    }
+
+    free(request->body_data);
+
+    if (request->body_buf) {
+        rbuf_release(request->body_buf);
+    }
+
+    loop->arena_mallocs += request->arena.mallocs;
+    request->arena.mallocs = 0;
+    arena_reset(&request->arena);
+
+    if (loop->requests_idle < REQUEST_POOL_MAX) {
+        request->next = loop->requests;
+        loop->requests = request;
+        loop->requests_idle++;
+    }
+    else {
+        arena_destroy(&request->arena);
+        free(request);
+    }
+
+    client_release(client);
 }
 
 uv_buf_t on_alloc(uv_handle_t *handle, size_t suggested_size)
 {
-    (void)handle;
+    client_t *client = (client_t *)handle->data;
+    rbuf_t *rbuf = rbuf_get(client->loop);
+    (void)suggested_size;
     uv_buf_t buf;
-    buf.base = malloc(suggested_size);
-    buf.len = suggested_size;
+    buf.base = rbuf->data;
+    buf.len = RBUF_SIZE;
     return buf;
 }
 
@@ -61,31 +148,48 @@ void on_read(uv_stream_t *tcp, ssize_t nread, uv_buf_t buf)
 {
     ssize_t parsed;
     client_t *client = (client_t *)tcp->data;
+    rbuf_t *rbuf = buf.base ? container_of(buf.base, rbuf_t, data) : NULL;
 
-    if (nread >= 0) {
+    if (nread < 0) {
+        uv_close((uv_handle_t *)&client->handle, on_close);
+    }
+    else if (!client->stopped) {
+        client->rbuf = rbuf;
         parsed = http_parser_execute(&client->parser, &parser_settings, buf.base, nread);
+        client->rbuf = NULL;
 
-        if (parsed < nread) {
+        if (parsed < nread && !client->stopped) {
             uv_close((uv_handle_t *)&client->handle, on_close);
         }
     }
-    else {
-        uv_close((uv_handle_t *)&client->handle, on_close);
-    }
 
-    free(buf.base);
+    /* input behind a stream is dropped, reading goes on to notice the close */
+
+    if (rbuf) {
+        rbuf_release(rbuf);
+    }
 }
 
 void on_connect(uv_stream_t *server_handle, int status)
 {
     uv_check(status, "connect");
     int r;
-    assert((uv_tcp_t *)server_handle == &server);
+    loop_t *loop = container_of(server_handle, loop_t, server);
+    assert(loop == loop_self);
     client_t *client = malloc(sizeof(client_t));
-    uv_tcp_init(uv_loop, &client->handle);
+    uv_tcp_init(loop->loop, &client->handle);
     http_parser_init(&client->parser, HTTP_REQUEST);
     client->parser.data = client;
     client->handle.data = client;
+    client->refs = 1;
+    client->closed = 0;
+    client->stopped = 0;
+    client->loop = loop;
+    client->head = NULL;
+    client->tail = &client->head;
+    client->rbuf = NULL;
+    client->flush_queued = 0;
+    client->flush_next = NULL;
     r = uv_accept(server_handle, (uv_stream_t *)&client->handle);
     uv_check(r, "accept");
     uv_read_start((uv_stream_t *)&client->handle, on_alloc, on_read);
@@ -95,21 +199,99 @@ int on_message_begin(http_parser *parser)
 {
     client_t *client = (client_t *)parser->data;
     client->keepalive = 0;
-    request_t *request = malloc(sizeof(request_t));
+    client->refs++;
+    request_t *request = request_new(client->loop);
     request->qname_length = 0;
     request->body_length = 0;
+    request->format = format_none;
+    request->count = 0;
+    request->wait = 0;
+    request->reserve = 0;
+    request->pos = 0;
+    request->due = 0;
+    request->priority = 0;
+    request->retain = 0;
+    request->ack = 0;
+    request->header_field_length = 0;
+    request->header_value_length = 0;
     request->client = client;
+    request->loop = client->loop;
+    request->body = NULL;
+    request->body_buf = NULL;
+    request->body_data = NULL;
+    request->body_size = 0;
+    request->body_expected = 0;
+    request->ready = 0;
+    request->client_next = NULL;
+    request->wait_next = NULL;
+    request->wait_pprev = NULL;
+    request->timeout.next = NULL;
+    request->timeout.pprev = NULL;
+    request->stream.credit = 0;
+    request->stream.inflight = 0;
+    request->stream.writes = 0;
+    request->stream.pulling = 0;
+    request->stream.started = 0;
+    request->stream.ended = 0;
+    request->chunk = NULL;
+    request->queue = NULL;
+    request->keys = NULL;
+    request->nkeys = 0;
+    request->keybuf = NULL;
+    request->items = NULL;
+    request->done = NULL;
+    request->batched = 0;
+    request->next = NULL;
     parser->data = request;
     return 0;
 }
 
+/* look up an unsigned integer parameter in a query string, returns 1 if found */
+int query_uint(const char *query, size_t len, const char *name, uint64_t *value)
+{
+    const char *p = query, *end = query + len;
+    size_t name_length = strlen(name);
+
+    while (p < end) {
+        const char *amp = memchr(p, '&', end - p);
+
+        if (!amp) {
+            amp = end;
+        }
+
+        if ((size_t)(amp - p) > name_length && p[name_length] == '=' && !memcmp(p, name, name_length)) {
+            uint64_t v = 0;
+            p += name_length + 1;
+
+            if (p == amp) {
+                return 0;
+            }
+
+            while (p < amp) {
+                if (*p < '0' || *p > '9') {
+                    return 0;
+                }
+
+                v = v * 10 + (*p++ - '0');
+            }
+
+            *value = v;
+            return 1;
+        }
+
+        p = amp + 1;
+    }
+
+    return 0;
+}
+
 int on_url(http_parser *parser, const char *at, size_t length)
 {
     request_t *request = (request_t *)parser->data;
     struct http_parser_url url;
     http_parser_parse_url(at, length, 0, &url);
 
-    if (url.field_set & (1 << UF_PATH)) {
+    if ((url.field_set & (1 << UF_PATH)) && url.field_data[UF_PATH].len <= MAX_QNAME_LENGTH) {
         if (at[url.field_data[UF_PATH].off] == '/') {
             if (url.field_data[UF_PATH].len > 1) {
                 request->qname_length = url.field_data[UF_PATH].len - 1;
@@ -124,6 +306,75 @@ int on_url(http_parser *parser, const char *at, size_t length)
         }
     }
 
+    if (url.field_set & (1 << UF_QUERY)) {
+        const char *query = at + url.field_data[UF_QUERY].off;
+        size_t query_length = url.field_data[UF_QUERY].len;
+        uint64_t delay;
+        query_uint(query, query_length, "n", &request->count);
+        query_uint(query, query_length, "wait", &request->wait);
+        query_uint(query, query_length, "reserve", &request->reserve);
+        request->ack = query_uint(query, query_length, "ack", &request->pos);
+
+        if (query_uint(query, query_length, "delay", &delay) && delay) {
+            request->due = delay_now() + delay;
+        }
+
+        query_uint(query, query_length, "at", &request->due);
+        query_uint(query, query_length, "priority", &request->priority);
+        request->retain = (query_uint(query, query_length, "max_length", &request->retention.max_length) ? RETAIN_SET_LENGTH : 0) |
+                          (query_uint(query, query_length, "max_bytes", &request->retention.max_bytes) ? RETAIN_SET_BYTES : 0) |
+                          (query_uint(query, query_length, "max_age", &request->retention.max_age) ? RETAIN_SET_AGE : 0);
+
+        if (request->priority >= QUEUE_LANES) {
+            request->priority = QUEUE_LANES - 1;
+        }
+
+        query_uint(query, query_length, "subscribe", &request->stream.credit);
+
+        if (request->stream.credit > MAX_GET_COUNT) {
+            request->stream.credit = MAX_GET_COUNT;
+        }
+    }
+
+    return 0;
+}
+
+/* act on a complete header, only the ones levelq knows about are kept */
+void request_header(request_t *request)
+{
+    if (request->header_field_length == 7 && !strncasecmp(request->header_field, "X-Batch", 7)) {
+        request->format = frame_format(request->header_value, request->header_value_length);
+    }
+
+    request->header_field_length = 0;
+    request->header_value_length = 0;
+}
+
+int on_header_field(http_parser *parser, const char *at, size_t length)
+{
+    request_t *request = (request_t *)parser->data;
+
+    if (request->header_value_length) {
+        request_header(request);
+    }
+
+    if (request->header_field_length + length <= sizeof(request->header_field)) {
+        memcpy(request->header_field + request->header_field_length, at, length);
+    }
+
+    request->header_field_length += length;
+    return 0;
+}
+
+int on_header_value(http_parser *parser, const char *at, size_t length)
+{
+    request_t *request = (request_t *)parser->data;
+
+    if (request->header_value_length + length <= sizeof(request->header_value)) {
+        memcpy(request->header_value + request->header_value_length, at, length);
+    }
+
+    request->header_value_length += length;
     return 0;
 }
 
@@ -131,326 +382,1510 @@ int on_headers_complete(http_parser *parser)
 {
     request_t *request = (request_t *)parser->data;
     client_t *client = request->client;
+
+    if (request->header_field_length) {
+        request_header(request);
+    }
+
     request->method = (enum http_method)parser->method;
     client->keepalive = http_should_keep_alive(parser);
+    request->keepalive = client->keepalive;
+
+    if (!(parser->flags & F_CHUNKED) && (uint64_t)parser->content_length != (uint64_t) -1) {
+        request->body_expected = parser->content_length;
+
+        if (request->body_expected > conf->max_message_size) {
+            return request_too_large(request);
+        }
+    }
+
     return 0;
 }
 
+/*
+ * Gather the body. A body that arrives in one read stays where it is in the
+ * read buffer. One that spans several is copied into a buffer big enough
+ * for all of it when Content-Length is known, a pooled read buffer if that
+ * is enough, and one that grows as chunks arrive otherwise.
+ */
 int on_body(http_parser *parser, const char *at, size_t length)
 {
     request_t *request = (request_t *)parser->data;
-    request->body = at;
-    request->body_length = length;
-    return 0;
-}
+    client_t *client = request->client;
+    size_t size;
 
-int queue_getput_pos(char *queue, uint64_t *getpos, uint64_t *putpos)
-{
-    char tmp[48] = {0};
-    dbi_t k, *vp;
-    k.data = queue;
-    k.len = strlen(queue);
-    vp = db_get(&k);
+    if (request->body_length + length > conf->max_message_size) {
+        /* a chunked body is only known to be too large once it is */
+        return request_too_large(request);
+    }
 
-    if (vp->err != NULL) {
-        twarnx("%s", vp->err);
-        dbi_destroy(vp);
-        return -1;
+    if (request->body_length == 0) {
+        /* keep the read buffer for as long as the request needs its body */
+        rbuf_ref(client->rbuf);
+        request->body_buf = client->rbuf;
+        request->body = at;
+        request->body_length = length;
+        return 0;
     }
-    else if (vp->data == NULL) {
-        // key not exists
-        *getpos = 0;
-        *putpos = 0;
-        dbi_destroy(vp);
-        return 1;
+
+    if (request->body_size == 0) {
+        /* the body so far is in a read buffer that is shared with other reads */
+        rbuf_t *rbuf = request->body_buf;
+        size = request->body_expected ? request->body_expected : 2 * (request->body_length + length);
+
+        if (size <= RBUF_SIZE) {
+            request->body_buf = rbuf_get(client->loop);
+            request->body_size = RBUF_SIZE;
+            memcpy(request->body_buf->data, request->body, request->body_length);
+            request->body = request->body_buf->data;
+        }
+        else {
+            request->body_buf = NULL;
+            request->body_data = malloc(size);
+            assert(request->body_data);
+            request->body_size = size;
+            memcpy(request->body_data, request->body, request->body_length);
+            request->body = request->body_data;
+        }
+
+        rbuf_release(rbuf);
     }
-    else {
-        int r;
-        uint64_t get, put;
-        memcpy(tmp, vp->data, vp->len);
-        r = sscanf(tmp, "%"PRIu64",%"PRIu64, &get, &put);
 
-        if (r == 2) {
-            *getpos = get;
-            *putpos = put;
-            dbi_destroy(vp);
-            return 0;
+    if (request->body_length + length > request->body_size) {
+        size = request->body_size * 2;
+
+        while (size < request->body_length + length) {
+            size *= 2;
+        }
+
+        if (size > conf->max_message_size) {
+            size = conf->max_message_size;
+        }
+
+        if (request->body_buf) {
+            request->body_data = malloc(size);
+            assert(request->body_data);
+            memcpy(request->body_data, request->body, request->body_length);
+            rbuf_release(request->body_buf);
+            request->body_buf = NULL;
         }
         else {
-            twarnx("invalid key: %.*s", (int)vp->len, vp->data);
-            dbi_destroy(vp);
-            return -1;
+            request->body_data = realloc(request->body_data, size);
+            assert(request->body_data);
         }
+
+        request->body_size = size;
+        request->body = request->body_data;
     }
-}
 
-void set_queue_getput_pos(char *qname, int qlen, uint64_t getpos, uint64_t putpos)
-{
-    dbi_t key, val;
-    char s[48];
-    int len = snprintf(s, 48, "%" PRIu64 ",%" PRIu64, getpos, putpos);
-    val.data = s;
-    val.len = len;
-    key.data = qname;
-    key.len = qlen;
-    db_put(&key, &val);
+    memcpy((char *)request->body + request->body_length, at, length);
+    request->body_length += length;
+    return 0;
 }
 
+/* the requests of a write are chained by next, from the one whose write_req it is */
 void after_write(uv_write_t *req, int status)
 {
     uv_check(status, "write");
-    request_t *request = (request_t *)req;
-    client_t *client = request->client;
-    repbuf_t *repbuf = request->write_req.data;
-    repbuf_free(repbuf);
-    free(request);
+    request_t *request = (request_t *)req, *next;
+    int keepalive = 1;
+    wheel_remove(&loop_self->wheel, &request->timeout);
 
-    if (!status) {
-        if (!client->keepalive && !uv_is_closing((uv_handle_t *)req->handle)) {
-            uv_close((uv_handle_t *)req->handle, on_close);
-        }
+    for (next = request; next; next = next->next) {
+        keepalive = keepalive && next->keepalive;
     }
-    else if (!uv_is_closing((uv_handle_t *)req->handle)) {
+
+    if ((status || !keepalive) && !uv_is_closing((uv_handle_t *)req->handle)) {
         uv_close((uv_handle_t *)req->handle, on_close);
     }
+
+    for (; request; request = next) {
+        next = request->next;
+        request_free(request);
+    }
+}
+/* format the response header and point the reply at body */
+void request_reply(request_t *request, status_t status, const char *body, size_t body_length)
+{
+    repbuf_t *repbuf = request->write_req.data;
+    request->reply = request->reply_buf;
+    request->nreply = 2;
+    request->reply[0].base = repbuf->buf;
+    request->reply[0].len = reply_header(repbuf->buf, status, body_length, request->keepalive);
+    request->reply[1].base = (char *)body;
+    request->reply[1].len = body_length;
 }
 
-int on_message_complete(http_parser *parser)
+/* like request_reply, but the body is bufs[1..nbufs), bufs[0] gets the header */
+void request_replyv(request_t *request, status_t status, uv_buf_t *bufs, unsigned int nbufs)
 {
-    request_t *request = (request_t *)parser->data;
-    client_t *client = request->client;
-    parser->data = client;
-    char qname[255];
-    int qlen, len, r;
-    uint64_t getpos, putpos;
-    dbi_t k, v, *vp;
-    repbuf_t *repbuf  = repbuf_new(BUFSIZE);
-    request->write_req.data = repbuf;
+    repbuf_t *repbuf = request->write_req.data;
+    size_t body_length = 0;
+    unsigned int i;
 
-    if (request->qname_length == 0 ||  strspn(request->qname, QUEUE_CHARS) != request->qname_length) {
-        /* invalid qname */
-        len = snprintf(repbuf->buf, BUFSIZE, HEADER, 400, "Bad Request", (size_t)18,
-                       client->keepalive ? "keep-alive" : "close");
-        uvbuf[0].base = repbuf->buf;
-        uvbuf[0].len = len;
-        uvbuf[1].base = "INVALID QUEUE NAME";
-        uvbuf[1].len = 18;
-        uv_write(&request->write_req, (uv_stream_t *)&client->handle, uvbuf, 2, after_write);
-        return 0;
+    for (i = 1; i < nbufs; i++) {
+        body_length += bufs[i].len;
     }
 
-    switch (request->method) {
-        case HTTP_GET:
-            r = queue_getput_pos(request->qname, &getpos, &putpos);
-
-            if (r > 0) {
-                len = snprintf(repbuf->buf, BUFSIZE, HEADER, 404, "NOT FOUND", (size_t)16, client->keepalive ? "keep-alive" : "close");
-                uvbuf[0].base = repbuf->buf;
-                uvbuf[0].len = len;
-                uvbuf[1].base = "QUEUE NOT EXISTS";
-                uvbuf[1].len = 16;
-                uv_write(&request->write_req, (uv_stream_t *)&client->handle, uvbuf, 2, after_write);
-                break;
-            }
-            else if (r < 0) {
-                len = snprintf(repbuf->buf, BUFSIZE, HEADER, 500, "Internal Server Error", (size_t)21,
-                               client->keepalive ? "keep-alive" : "close");
-                uvbuf[0].base = repbuf->buf;
-                uvbuf[0].len = len;
-                uvbuf[1].base = "Internal Server Error";
-                uvbuf[1].len = 21;
-                uv_write(&request->write_req, (uv_stream_t *)&client->handle, uvbuf, 2, after_write);
-                break;
-            }
+    bufs[0].base = repbuf->buf;
+    bufs[0].len = reply_header(repbuf->buf, status, body_length, request->keepalive);
+    request->reply = bufs;
+    request->nreply = nbufs;
+}
 
-            if (getpos == putpos) {
-                len = snprintf(repbuf->buf, BUFSIZE, HEADER, 404, "NOT FOUND", (size_t)11, client->keepalive ? "keep-alive" : "close");
-                uvbuf[0].base = repbuf->buf;
-                uvbuf[0].len = len;
-                uvbuf[1].base = "QUEUE EMPTY";
-                uvbuf[1].len = 11;
-                uv_write(&request->write_req, (uv_stream_t *)&client->handle, uvbuf, 2, after_write);
-                break;
-            }
+/* a reply that is always the same, header and body were built at startup */
+void request_reply_static(request_t *request, reply_t reply)
+{
+    request->reply = request->reply_buf;
+    request->nreply = 1;
+    request->reply[0] = reply_static(reply, request->keepalive);
+}
 
-            qlen = snprintf(qname, sizeof(qname), "%s:%"PRIu64, request->qname, getpos);
-            k.len = qlen;
-            k.data = qname;
-            vp = db_get(&k);
-            repbuf->item = vp;
-
-            if (vp->err != NULL) {
-                uvbuf[1].base = vp->err;
-                uvbuf[1].len = strlen(vp->err);
-                len = snprintf(repbuf->buf, BUFSIZE, HEADER, 400, "Bad Request", uvbuf[1].len,
-                               client->keepalive ? "keep-alive" : "close");
-                uvbuf[0].base = repbuf->buf;
-                uvbuf[0].len = len;
-                uv_write(&request->write_req, (uv_stream_t *)&client->handle, uvbuf, 2, after_write);
+/*
+ * Copy the values the reply of a request points to in the db, so the db is
+ * free to grow while the reply waits. The reply takes them in item order.
+ */
+void request_detach(request_t *request)
+{
+    size_t i;
+    unsigned int j = 0, k;
+    char *data;
+
+    for (i = 0; i < request->nkeys; i++) {
+        if (!request->items[i].pin) {
+            continue;
+        }
+
+        data = request->items[i].data;
+        dbi_detach(&request->items[i]);
+
+        for (k = 0; k < request->nreply; k++, j = (j + 1) % request->nreply) {
+            if (request->reply[j].base == data) {
+                request->reply[j].base = request->items[i].data;
                 break;
             }
+        }
+    }
+}
 
-            set_queue_getput_pos(request->qname, request->qname_length, getpos + 1, putpos);
-            len = snprintf(repbuf->buf, BUFSIZE, HEADER, 200, "OK", vp->len, client->keepalive ? "keep-alive" : "close");
-            uvbuf[0].base = repbuf->buf;
-            uvbuf[0].len = len;
-            uvbuf[1].base = vp->data;
-            uvbuf[1].len = vp->len;
-            uv_write(&request->write_req, (uv_stream_t *)&client->handle, uvbuf, 2, after_write);
+int request_pinned(request_t *request)
+{
+    size_t i;
 
-            if (conf->delete_after_get) {
-                db_delete(&k);
-            }
+    for (i = 0; i < request->nkeys; i++) {
+        if (request->items[i].pin) {
+            return 1;
+        }
+    }
 
-            break;
+    return 0;
+}
 
-        case HTTP_PUT:
-            r = queue_getput_pos(request->qname, &getpos, &putpos);
+/* a write holding pinned reads is not done yet, the db may be waiting for them */
+void on_write_stalled(wheel_entry_t *entry)
+{
+    request_t *request = container_of(entry, request_t, timeout);
+    uv_handle_t *handle = (uv_handle_t *)&request->client->handle;
 
-            if (r < 0) {
-                len = snprintf(repbuf->buf, BUFSIZE, HEADER, 500, "Internal Server Error", (size_t)21,
-                               client->keepalive ? "keep-alive" : "close");
-                uvbuf[0].base = repbuf->buf;
-                uvbuf[0].len = len;
-                uvbuf[1].base = "Internal Server Error";
-                uvbuf[1].len = 21;
-                uv_write(&request->write_req, (uv_stream_t *)&client->handle, uvbuf, 2, after_write);
-                break;
-            }
+    if (uv_is_closing(handle)) {
+        return;
+    }
 
-            qlen = snprintf(qname, sizeof(qname), "%s:%"PRIu64, request->qname, putpos);
-            k.data = qname;
-            k.len = qlen;
-            v.data = (char *)request->body;
-            v.len = request->body_length;
-            db_put(&k, &v);
-            set_queue_getput_pos(request->qname, request->qname_length, getpos, putpos + 1);
-            len = snprintf(repbuf->buf, BUFSIZE, HEADER, 200, "OK", (size_t)2, client->keepalive ? "keep-alive" : "close");
-            uvbuf[0].base = repbuf->buf;
-            uvbuf[0].len = len;
-            uvbuf[1].base = "OK";
-            uvbuf[1].len = 2;
-            uv_write(&request->write_req, (uv_stream_t *)&client->handle, uvbuf, 2, after_write);
-            break;
+    if (db_growing && db_growing()) {
+        /* the canceled write releases the pins */
+        uv_close(handle, on_close);
+        return;
+    }
 
-        case HTTP_DELETE:
-        case HTTP_PURGE:
-            set_queue_getput_pos(request->qname, request->qname_length, 0, 0);
-            len = snprintf(repbuf->buf, BUFSIZE, HEADER, 200, "OK", (size_t)2, client->keepalive ? "keep-alive" : "close");
-            uvbuf[0].base = repbuf->buf;
-            uvbuf[0].len = len;
-            uvbuf[1].base = "OK";
-            uvbuf[1].len = 2;
-            uv_write(&request->write_req, (uv_stream_t *)&client->handle, uvbuf, 2, after_write);
-            break;
+    wheel_add(&loop_self->wheel, entry, PINNED_WRITE_MAX, on_write_stalled);
+}
 
-        case HTTP_OPTIONS:
-            r = queue_getput_pos(request->qname, &getpos, &putpos);
+/* write the requests chained from first, their replies take nbufs buffers */
+void client_write(client_t *client, request_t *first, unsigned int nbufs)
+{
+    request_t *request;
+    uv_buf_t *bufs;
+    unsigned int i;
+    int pinned = 0;
 
-            if (r < 0) {
-                len = snprintf(repbuf->buf, BUFSIZE, HEADER, 500, "Internal Server Error", (size_t)21,
-                               client->keepalive ? "keep-alive" : "close");
-                uvbuf[0].base = repbuf->buf;
-                uvbuf[0].len = len;
-                uvbuf[1].base = "Internal Server Error";
-                uvbuf[1].len = 21;
-                uv_write(&request->write_req, (uv_stream_t *)&client->handle, uvbuf, 2, after_write);
-                break;
-            }
+    if (uv_is_closing((uv_handle_t *)&client->handle)) {
+        for (request = first; request; request = first) {
+            first = request->next;
+            request_free(request);
+        }
 
-            len = snprintf(repbuf->buf, BUFSIZE, "{\"name\":\"%s\",\"putpos\":%"PRIu64",\"getpos\":%"PRIu64"}\n", request->qname,
-                           putpos, getpos);
-            uvbuf[1].base = repbuf->buf;
-            uvbuf[1].len = len;
-            uvbuf[0].base = repbuf->buf + len + 2;
-            len = snprintf(repbuf->buf + len + 2, BUFSIZE - len - 1, HEADER, 200, "OK", (size_t)len,
-                           client->keepalive ? "keep-alive" : "close");
-            uvbuf[0].len = len;
-            uv_write(&request->write_req, (uv_stream_t *)&client->handle, uvbuf, 2, after_write);
-            break;
+        return;
+    }
 
-        default:
-            len = snprintf(repbuf->buf, BUFSIZE, HEADER, 400, "Bad Request", (size_t)14,
-                           client->keepalive ? "keep-alive" : "close");
-            uvbuf[0].base = repbuf->buf;
-            uvbuf[0].len = len;
-            uvbuf[1].base = "INVALID METHOD";
-            uvbuf[1].len = 14;
-            uv_write(&request->write_req, (uv_stream_t *)&client->handle, uvbuf, 2, after_write);
-            break;
+    for (request = first; request; request = request->next) {
+        if (client->handle.write_queue_size) {
+            /* behind writes the client has not taken yet */
+            request_detach(request);
+        }
+        else {
+            pinned = pinned || request_pinned(request);
+        }
     }
 
-    return 0;
+    if (!first->next) {
+        uv_write(&first->write_req, (uv_stream_t *)&client->handle, first->reply, first->nreply, after_write);
+    }
+    else {
+        bufs = arena_alloc(&first->arena, nbufs * sizeof(uv_buf_t));
+
+        for (request = first, i = 0; request; request = request->next) {
+            memcpy(bufs + i, request->reply, request->nreply * sizeof(uv_buf_t));
+            i += request->nreply;
+        }
+
+        uv_write(&first->write_req, (uv_stream_t *)&client->handle, bufs, nbufs, after_write);
+    }
+
+    if (pinned && client->handle.write_queue_size) {
+        /* what the socket did not take points into the db until written */
+        wheel_add(&loop_self->wheel, &first->timeout, PINNED_WRITE_MAX, on_write_stalled);
+    }
 }
 
-void signal_handler(int sig)
+/*
+ * Write the replies of a client that are ready, in the order the requests
+ * came in, all of them in one write. Runs on the loop of the connection.
+ * A stream stays at the head and gets its chunks written by stream_flush,
+ * it is the last request read from its connection.
+ */
+void client_flush(client_t *client)
 {
-    uv_stop(uv_loop);
-    db_close();
-    terrx(sig, "receive signal %d, exited.", sig);
+    request_t *first = client->head, *request, **tail = &first;
+    unsigned int nbufs = 0;
+
+    while (client->head && client->head->ready && !client->head->stream.credit) {
+        request = client->head;
+        client->head = request->client_next;
+        nbufs += request->nreply;
+        *tail = request;
+        tail = &request->next;
+    }
+
+    if (!client->head) {
+        client->tail = &client->head;
+    }
+
+    *tail = NULL;
+
+    if (nbufs) {
+        client_write(client, first, nbufs);
+    }
+
+    /* replies that wait behind one that is not ready copy their values */
+    for (request = client->head; request; request = request->client_next) {
+        if (request->ready) {
+            request_detach(request);
+        }
+    }
+
+    if (client->head && client->head->ready) {
+        stream_flush(client->head);
+    }
 }
 
-int main(int argc, char *argv[])
+/* flush every client that got replies ready in this loop iteration */
+void on_flush_check(uv_check_t *handle, int status)
 {
-    int r;
+    loop_t *loop = container_of(handle, loop_t, flush_check);
+    client_t *client;
+    (void)status;
 
-    if (argc == 2 && conf_loadfile(conf, argv[1]) != 0) {
-        terrx(1, "failed to load conf %s", argv[1]);
+    while ((client = loop->flush_head)) {
+        loop->flush_head = client->flush_next;
+        client->flush_queued = 0;
+        client_flush(client);
+        client_release(client);
     }
+}
 
-    switch (conf->engine) {
-        case engine_leveldb:
-            db_leveldb_init();
-            db_get = db_leveldb_get;
-            db_put = db_leveldb_put;
-            db_delete = db_leveldb_delete;
-            db_close = db_leveldb_close;
-            break;
+/*
+ * The reply can be written. It waits for the end of the loop iteration, so
+ * pipelined requests and storage jobs that finish together share a write.
+ */
+void request_ready(request_t *request)
+{
+    client_t *client = request->client;
+    request->ready = 1;
 
-        case engine_lmdb:
-            db_lmdb_init();
-            db_get = db_lmdb_get;
-            db_put = db_lmdb_put;
-            db_delete = db_lmdb_delete;
-            db_close = db_lmdb_close;
-            break;
+    if (!client->flush_queued) {
+        client->flush_queued = 1;
+        client->refs++;
+        client->flush_next = client->loop->flush_head;
+        client->loop->flush_head = client;
+    }
+}
 
-        case engine_unqlite:
-            db_unqlite_init();
-            db_get = db_unqlite_get;
-            db_put = db_unqlite_put;
-            db_delete = db_unqlite_delete;
-            db_close = db_unqlite_close;
-            break;
+/* the reply of a request is formatted, hand it back to its connection */
+void request_complete(request_t *request)
+{
+    if (request->loop == loop_self) {
+        request_ready(request);
+        return;
+    }
 
-        default:
-            terrx(-1, "unsuppored db engine");
+    loop_post(request->loop, request);
+}
+
+/* called once the storage job of a request has run */
+void request_finish(request_t *request, int failed)
+{
+    if (failed && request->stream.credit) {
+        queue_invalidate(request->queue);
+        stream_end(request);
+    }
+    else if (failed) {
+        queue_invalidate(request->queue);
+        request_reply_static(request, reply_error);
+    }
+    else if (request->done) {
+        request->done(request);
     }
 
-    parser_settings.on_message_begin = on_message_begin;
-    parser_settings.on_url = on_url;
-    parser_settings.on_body = on_body;
-    parser_settings.on_headers_complete = on_headers_complete;
-    parser_settings.on_message_complete = on_message_complete;
-    uv_loop = uv_default_loop();
-    r = uv_tcp_init(uv_loop, &server);
-    uv_assert(r, "uv_tcp_init");
-    uv_tcp_keepalive(&server, conf->tcp_keepalive, conf->tcp_keepalive);
-    uv_tcp_nodelay(&server, conf->tcp_nodelay);
-    struct sockaddr_in address = uv_ip4_addr(conf->host, conf->port);
-    r = uv_tcp_bind(&server, address);
-    uv_assert(r, "uv_tcp_bind");
-    r = uv_listen((uv_stream_t *)&server, 128, on_connect);
-    uv_assert(r, "uv_listen");
-    printf("            levelq "LEVELQ_VERSION"\n");
-    printf("engine:                   : %s\n", conf->engine == engine_leveldb ? "leveldb" :
-           conf->engine == engine_lmdb ? "lmdb" :
+    request_complete(request);
+}
+
+/*
+ * PUT of several messages at once: reserve as many positions as there are
+ * messages and write them all in the pending batch. The reply holds the
+ * positions they were given.
+ */
+void put_batch(request_t *request, queue_t *queue)
+{
+    repbuf_t *repbuf = request->write_req.data;
+    const char *p = request->body, *end = request->body + request->body_length, *item;
+    char qname[MAX_KEY_LENGTH];
+    char *json, *start;
+    uint64_t pos, first, bytes = 0;
+    lane_t *lane = &queue->lanes[request->priority];
+    int n;
+    dbi_t k, v;
+    n = frame_count(request->format, request->body, request->body_length);
+
+    if (n < 0) {
+        request_reply_static(request, reply_invalid_batch);
+        return;
+    }
+
+    if (n == 0) {
+        request_reply_static(request, reply_empty_batch);
+        return;
+    }
+
+    if (request->due) {
+        /* delayed messages have no positions yet */
+        while (frame_next(request->format, &p, end, &item, &v.len) > 0) {
+            v.data = (char *)item;
+            delay_put(queue, request->priority, request->due, &v);
+        }
+
+        request->queue = queue;
+        request->batched = 1;
+        request_reply_static(request, reply_ok);
+        return;
+    }
+
+    first = pos = lane->putpos;
+    k.data = qname;
+
+    while (frame_next(request->format, &p, end, &item, &v.len) > 0) {
+        v.data = (char *)item;
+        k.len = key_item(qname, request->qname, request->qname_length, pos++);
+        dbbatch_put(batch, &k, &v);
+        cache_put(queue, request->priority, pos - 1, v.data, v.len);
+        bytes += v.len;
+    }
+
+    queue_put(queue, request->priority, n, bytes);
+
+    queue->exists = 1;
+    queue->dirty = 1;
+    queue_save(queue, batch);
+    request->queue = queue;
+    request->batched = 1;
+    /* {"name":"<qname>","first":<first>,"last":<last>} */
+    start = json = repbuf->buf + BUFSIZE;
+    memcpy(json, "{\"name\":\"", 9);
+    json += 9;
+    memcpy(json, request->qname, request->qname_length);
+    json += request->qname_length;
+    memcpy(json, "\",\"first\":", 10);
+    json += 10;
+    json += reply_uint(json, first);
+    memcpy(json, ",\"last\":", 8);
+    json += 8;
+    json += reply_uint(json, lane->putpos - 1);
+    memcpy(json, "}\n", 2);
+    json += 2;
+    request_reply(request, status_ok, start, json - start);
+}
+
+/* room for the keys of n messages */
+void request_keys_alloc(request_t *request, size_t n)
+{
+    size_t size = request->stream.credit ? request->stream.credit : n;
+
+    if (!request->keys) {
+        /* a stream reads over and over, never more than its credit at once */
+        request->keys = arena_alloc(&request->arena, size * sizeof(dbi_t));
+        request->keybuf = arena_alloc(&request->arena, size * MAX_KEY_LENGTH);
+        request->items = arena_alloc(&request->arena, size * sizeof(dbi_t));
+    }
+}
+
+/*
+ * Add the keys of n messages from pos on to the ones to read. The ones in
+ * the tail cache of the queue are taken from there, the storage job skips
+ * items that already have data.
+ */
+void request_keys(request_t *request, queue_t *queue, uint64_t pos, size_t n)
+{
+    size_t i;
+
+    for (i = request->nkeys; i < request->nkeys + n; i++) {
+        dbi_init(&request->items[i]);
+        cache_take(queue, pos, &request->items[i]);
+        request->keys[i].data = request->keybuf + i * MAX_KEY_LENGTH;
+        request->keys[i].len = key_item(request->keys[i].data, request->qname, request->qname_length, pos++);
+    }
+
+    request->nkeys += n;
+}
+
+/*
+ * Take up to n messages off the head of a queue, highest priority lane
+ * first: positions advance now, the items are read by the storage job and
+ * request->done builds the reply.
+ */
+void request_read(request_t *request, queue_t *queue, size_t n)
+{
+    lane_t *lane;
+    uint64_t m;
+    int top;
+    request_keys_alloc(request, n);
+
+    while (n > 0 && (top = queue_top(queue)) >= 0) {
+        lane = &queue->lanes[top];
+        m = lane->putpos - lane->getpos;
+
+        if (m > n) {
+            m = n;
+        }
+
+        request_keys(request, queue, lane->getpos, m);
+        queue_take(queue, top, lane->getpos + m);
+        n -= m;
+    }
+
+    /* deletes are applied after the reads of the same job */
+    queue_ack(queue, batch);
+    queue_save(queue, batch);
+    request->queue = queue;
+    request->batched = 1;
+}
+
+void get_done(request_t *request)
+{
+    dbi_t *vp = &request->items[0];
+
+    if (vp->err != NULL) {
+        request_reply(request, status_bad_request, vp->err, strlen(vp->err));
+        return;
+    }
+
+    request_reply(request, status_ok, vp->data, vp->len);
+}
+
+/*
+ * Reply to a GET of several messages: they are sent back as
+ * <length>\n<data>\n frames, the same format X-Batch: frames takes.
+ */
+void get_batch_done(request_t *request)
+{
+    size_t i, n = request->nkeys;
+    uv_buf_t *bufs;
+    char *p;
+
+    for (i = 0; i < n; i++) {
+        if (request->items[i].err != NULL) {
+            request_reply(request, status_bad_request, request->items[i].err, strlen(request->items[i].err));
+            return;
+        }
+    }
+
+    /* header, then a length line and the data per message, then a newline */
+    bufs = arena_alloc(&request->arena, (2 * n + 2) * sizeof(uv_buf_t));
+    p = arena_alloc(&request->arena, n * 24);
+
+    for (i = 0; i < n; i++) {
+        bufs[1 + 2 * i].base = p;
+
+        if (i) {
+            *p++ = '\n';
+        }
+
+        p += reply_uint(p, request->items[i].len);
+        *p++ = '\n';
+        bufs[1 + 2 * i].len = p - bufs[1 + 2 * i].base;
+        bufs[2 + 2 * i].base = request->items[i].data;
+        bufs[2 + 2 * i].len = request->items[i].len;
+    }
+
+    bufs[2 * n + 1].base = "\n";
+    bufs[2 * n + 1].len = 1;
+    request_replyv(request, status_ok, bufs, 2 * n + 2);
+}
+
+stream_chunk_t *stream_chunk_new(size_t n)
+{
+    stream_chunk_t *chunk = malloc(sizeof(stream_chunk_t) + n * sizeof(dbi_t) + (2 * n + 3) * sizeof(uv_buf_t) + n * 24 + 24);
+    assert(chunk);
+    chunk->n = n;
+    chunk->end = 0;
+    chunk->items = (dbi_t *)(chunk + 1);
+    chunk->bufs = (uv_buf_t *)(chunk->items + n);
+    chunk->nbufs = 0;
+    chunk->text = (char *)(chunk->bufs + 2 * n + 3);
+    return chunk;
+}
+
+void stream_chunk_free(stream_chunk_t *chunk)
+{
+    size_t i;
+
+    for (i = 0; i < chunk->n; i++) {
+        dbi_clear(&chunk->items[i]);
+    }
+
+    free(chunk);
+}
+
+/* the stream can not go on, its last chunk ends the response */
+void stream_end(request_t *request)
+{
+    stream_chunk_t *chunk = stream_chunk_new(0);
+    chunk->end = 1;
+    chunk->bufs[1].base = "0\r\n\r\n";
+    chunk->bufs[1].len = 5;
+    chunk->nbufs = 1;
+    request->chunk = chunk;
+}
+
+/*
+ * The messages read for a stream become its next chunk, framed like the
+ * reply of GET ?n=. The chunk takes the items over, the request reads
+ * into the same arrays again next time.
+ */
+void stream_done(request_t *request)
+{
+    size_t i, n = request->nkeys, size = 0;
+    stream_chunk_t *chunk;
+    uv_buf_t *bufs;
+    char *p;
+
+    for (i = 0; i < n; i++) {
+        if (request->items[i].err != NULL) {
+            twarnx("%s", request->items[i].err);
+            stream_end(request);
+            return;
+        }
+    }
+
+    chunk = stream_chunk_new(n);
+    memcpy(chunk->items, request->items, n * sizeof(dbi_t));
+    request->nkeys = 0;
+
+    /* a subscriber may take its time, chunks must not hold up the db */
+    for (i = 0; i < n; i++) {
+        dbi_detach(&chunk->items[i]);
+    }
+
+    /* chunk size line, a length line and the data per message, newline and chunk end */
+    bufs = chunk->bufs + 1;
+    p = chunk->text + 24;
+
+    for (i = 0; i < n; i++) {
+        bufs[1 + 2 * i].base = p;
+
+        if (i) {
+            *p++ = '\n';
+        }
+
+        p += reply_uint(p, chunk->items[i].len);
+        *p++ = '\n';
+        bufs[1 + 2 * i].len = p - bufs[1 + 2 * i].base;
+        bufs[2 + 2 * i].base = chunk->items[i].data;
+        bufs[2 + 2 * i].len = chunk->items[i].len;
+        size += bufs[1 + 2 * i].len + bufs[2 + 2 * i].len;
+    }
+
+    bufs[2 * n + 1].base = "\n\r\n";
+    bufs[2 * n + 1].len = 3;
+    size++;
+    p = chunk->text;
+    p += reply_hex(p, size);
+    *p++ = '\r';
+    *p++ = '\n';
+    bufs[0].base = chunk->text;
+    bufs[0].len = p - chunk->text;
+    chunk->nbufs = 2 * n + 2;
+    request->chunk = chunk;
+}
+
+/* GET ?reserve= replies with the message and the position to ack it by */
+void reserve_done(request_t *request)
+{
+    dbi_t *vp = &request->items[0];
+    repbuf_t *repbuf = request->write_req.data;
+
+    if (vp->err != NULL) {
+        request_reply(request, status_bad_request, vp->err, strlen(vp->err));
+        return;
+    }
+
+    request_reply(request, status_ok, vp->data, vp->len);
+    request->reply[0].len = reply_header_position(repbuf->buf, status_ok, vp->len, request->keepalive, request->pos);
+}
+
+/* whether a GET has anything to take from the queue */
+int request_can_get(request_t *request, queue_t *queue)
+{
+    return queue->ready || (request->reserve && queue->redeliver);
+}
+
+void queue_wake(queue_t *queue);
+
+/* nobody acked the message in time, it is up for GET ?reserve= again */
+void on_reserve_timeout(wheel_entry_t *entry)
+{
+    reservation_t *reservation = container_of(entry, reservation_t, timeout);
+    reserve_expire(reservation);
+
+    if (reservation->queue->waiters) {
+        queue_wake(reservation->queue);
+    }
+}
+
+/*
+ * Hand out one message without taking it off the queue: a message whose
+ * visibility timeout ran out if there is one, the next new one otherwise.
+ * It stays hidden for request->reserve ms, or until it is acked.
+ */
+void request_reserve(request_t *request, queue_t *queue)
+{
+    reservation_t *reservation = reserve_next(queue);
+    uint64_t pos, timeout = request->reserve;
+    int top;
+
+    if (timeout > MAX_RESERVE) {
+        timeout = MAX_RESERVE;
+    }
+
+    if (!reservation) {
+        top = queue_top(queue);
+        pos = queue->lanes[top].getpos;
+        reservation = reserve_new(queue, pos);
+        queue_take(queue, top, pos + 1);
+        queue_save(queue, batch);
+        request->batched = 1;
+    }
+
+    wheel_add(&loop_self->wheel, &reservation->timeout, timeout, on_reserve_timeout);
+    request->pos = reservation->pos;
+    request_keys_alloc(request, 1);
+    request_keys(request, queue, reservation->pos, 1);
+    request->queue = queue;
+    request->done = reserve_done;
+}
+
+/* GET from a queue that has messages */
+void request_get(request_t *request, queue_t *queue)
+{
+    uint64_t n = 1;
+
+    if (request->count) {
+        n = queue_length(queue);
+
+        if (n > request->count) {
+            n = request->count;
+        }
+
+        if (n > MAX_GET_COUNT) {
+            n = MAX_GET_COUNT;
+        }
+    }
+
+    if (queue->dirty && ((request->reserve && queue->redeliver) || !cache_covers(queue, n))) {
+        /* the items may still be in the open batch, read after it is committed */
+        job_seal();
+    }
+
+    if (request->reserve) {
+        request_reserve(request, queue);
+        return;
+    }
+
+    if (request->count) {
+        request_read(request, queue, n);
+        request->done = request->stream.credit ? stream_done : get_batch_done;
+        return;
+    }
+
+    request_read(request, queue, 1);
+    request->done = get_done;
+}
+
+/* take a parked request off the waiters of its queue and out of the wheel */
+void request_unwait(request_t *request)
+{
+    queue_t *queue = request->queue;
+    *request->wait_pprev = request->wait_next;
+
+    if (request->wait_next) {
+        request->wait_next->wait_pprev = request->wait_pprev;
+    }
+    else {
+        queue->waiters_tail = request->wait_pprev;
+    }
+
+    request->wait_next = NULL;
+    request->wait_pprev = NULL;
+    wheel_remove(&loop_self->wheel, &request->timeout);
+}
+
+/* a parked GET gets nothing, a stream just reads again */
+void request_empty(request_t *request)
+{
+    if (request->stream.credit) {
+        request->chunk = NULL;
+    }
+    else {
+        request_reply_static(request, reply_queue_empty);
+    }
+
+    request_complete(request);
+}
+
+/* the wait of a parked GET is over and the queue is still empty */
+void on_wait_timeout(wheel_entry_t *entry)
+{
+    request_t *request = container_of(entry, request_t, timeout);
+    queue_t *queue = request->queue;
+    request_unwait(request);
+    request_empty(request);
+    queue_forget(queue);
+}
+
+/*
+ * GET ?wait= of an empty queue: park the request on the queue until a PUT
+ * brings a message or the wait runs out. Timeouts are kept in the timer
+ * wheel of the loop that owns the queue.
+ */
+void request_wait(request_t *request, queue_t *queue)
+{
+    uint64_t wait = request->wait;
+
+    if (wait > MAX_GET_WAIT) {
+        wait = MAX_GET_WAIT;
+    }
+
+    request->queue = queue;
+    request->wait_next = NULL;
+    request->wait_pprev = queue->waiters_tail;
+    *queue->waiters_tail = request;
+    queue->waiters_tail = &request->wait_next;
+    wheel_add(&loop_self->wheel, &request->timeout, wait, on_wait_timeout);
+}
+
+/*
+ * Hand the messages a PUT added, or ones to deliver again, to the GETs
+ * parked on the queue, oldest first. Only GET ?reserve= takes the latter.
+ */
+void queue_wake(queue_t *queue)
+{
+    request_t *request, *next;
+
+    for (request = queue->waiters; request && (queue->ready || queue->redeliver); request = next) {
+        next = request->wait_next;
+
+        if (!request_can_get(request, queue)) {
+            continue;
+        }
+
+        request_unwait(request);
+
+        if (request_closed(request)) {
+            /* nobody to deliver to, leave the messages for the next GET */
+            request_empty(request);
+            continue;
+        }
+
+        request_get(request, queue);
+        job_add(request);
+    }
+}
+
+/*
+ * Run a request on the loop that owns its queue. Requests that use storage
+ * go through a storage job of that loop.
+ */
+void request_process(request_t *request)
+{
+    char qname[MAX_KEY_LENGTH];
+    int qlen, len, r, i;
+    char *info;
+    queue_t *queue, *wake = NULL;
+    reservation_t *reservation;
+    dbi_t k, v;
+
+    switch (request->method) {
+        case HTTP_GET:
+            r = queue_lookup(request->qname, request->qname_length, &queue);
+
+            if (r < 0 && request->stream.credit) {
+                stream_end(request);
+                break;
+            }
+            else if (r < 0) {
+                request_reply_static(request, reply_error);
+                break;
+            }
+
+            if (!request_can_get(request, queue)) {
+                if (request->wait) {
+                    /* a queue that does not exist yet is waited on as well */
+                    request_wait(request, queue);
+                    return;
+                }
+
+                request_reply_static(request, r > 0 ? reply_queue_not_exists : reply_queue_empty);
+                queue_forget(queue);
+                break;
+            }
+
+            request_get(request, queue);
+            break;
+
+        case HTTP_PUT:
+            r = queue_lookup(request->qname, request->qname_length, &queue);
+
+            if (r < 0) {
+                request_reply_static(request, reply_error);
+                break;
+            }
+
+            if (!queue->admitted && db_admit && db_admit(request->qname, request->qname_length)) {
+                request_reply_static(request, reply_too_many_queues);
+                queue_forget(queue);
+                break;
+            }
+
+            queue->admitted = 1;
+
+            if (request->due && request->due <= delay_now()) {
+                request->due = 0;
+            }
+
+            if (request->format != format_none) {
+                put_batch(request, queue);
+                wake = queue;
+                break;
+            }
+
+            if (request->due) {
+                v.data = (char *)request->body;
+                v.len = request->body_length;
+                delay_put(queue, request->priority, request->due, &v);
+                request->queue = queue;
+                request->batched = 1;
+                request_reply_static(request, reply_ok);
+                break;
+            }
+
+            qlen = key_item(qname, request->qname, request->qname_length, queue->lanes[request->priority].putpos);
+            k.data = qname;
+            k.len = qlen;
+            v.data = (char *)request->body;
+            v.len = request->body_length;
+            dbbatch_put(batch, &k, &v);
+            cache_put(queue, request->priority, queue->lanes[request->priority].putpos, v.data, v.len);
+            queue_put(queue, request->priority, 1, v.len);
+            queue->exists = 1;
+            queue->dirty = 1;
+            queue_save(queue, batch);
+            request->queue = queue;
+            request->batched = 1;
+            request_reply_static(request, reply_ok);
+            wake = queue;
+            break;
+
+        case HTTP_DELETE:
+        case HTTP_PURGE:
+            r = queue_lookup(request->qname, request->qname_length, &queue);
+
+            if (r < 0) {
+                request_reply_static(request, reply_error);
+                break;
+            }
+
+            reserve_purge(queue);
+            delay_purge(queue);
+            queue_reset(queue);
+            queue->exists = 1;
+            queue_save(queue, batch);
+            request->queue = queue;
+            request->batched = 1;
+            request_reply_static(request, reply_ok);
+            break;
+
+        case HTTP_POST:
+            /*
+             * POST ?ack=<pos> acks a message of GET ?reserve=, POST with any
+             * of ?max_length=, ?max_bytes= and ?max_age= sets those limits
+             */
+            if (!request->ack && !request->retain) {
+                request_reply_static(request, reply_invalid_method);
+                break;
+            }
+
+            r = queue_lookup(request->qname, request->qname_length, &queue);
+
+            if (r < 0) {
+                request_reply_static(request, reply_error);
+                break;
+            }
+
+            if (request->retain) {
+                if (request->retain & RETAIN_SET_LENGTH) {
+                    queue->retention.max_length = request->retention.max_length;
+                }
+
+                if (request->retain & RETAIN_SET_BYTES) {
+                    queue->retention.max_bytes = request->retention.max_bytes;
+                }
+
+                if (request->retain & RETAIN_SET_AGE) {
+                    queue->retention.max_age = request->retention.max_age;
+                }
+
+                /* the limits are loaded with the positions, the queue has to exist */
+                queue->exists = 1;
+                queue_save(queue, batch);
+                queue_save_retention(queue, batch);
+                retain_watch(queue);
+                request->queue = queue;
+                request->batched = 1;
+                request_reply_static(request, reply_ok);
+                break;
+            }
+
+            if (!(reservation = reserve_find(queue, request->pos))) {
+                request_reply_static(request, reply_not_reserved);
+                queue_forget(queue);
+                break;
+            }
+
+            reserve_free(reservation);
+            queue_ack(queue, batch);
+            queue_save(queue, batch);
+            request->queue = queue;
+            request->batched = 1;
+            request_reply_static(request, reply_ok);
+            break;
+
+        case HTTP_OPTIONS:
+            r = queue_lookup(request->qname, request->qname_length, &queue);
+
+            if (r < 0) {
+                request_reply_static(request, reply_error);
+                break;
+            }
+
+            /* positions are of the default lane, "priorities" counts the messages of each lane */
+            info = arena_alloc(&request->arena, BUFSIZE * 2);
+            len = snprintf(info, BUFSIZE * 2, "{\"name\":\"%s\",\"putpos\":%"PRIu64",\"getpos\":%"PRIu64",\"ackpos\":%"PRIu64",\"delayed\":%"PRIu64",\"priorities\":[",
+                           request->qname, queue->lanes[0].putpos, queue->lanes[0].getpos, queue->lanes[0].ackpos, queue->delayed);
+
+            for (i = 0; i < QUEUE_LANES; i++) {
+                len += snprintf(info + len, BUFSIZE * 2 - len, "%s%"PRIu64, i ? "," : "",
+                                queue->lanes[i].putpos - queue->lanes[i].getpos);
+            }
+
+            len += snprintf(info + len, BUFSIZE * 2 - len, "],\"bytes\":%"PRIu64",\"retention\":{\"max_length\":%"PRIu64",\"max_bytes\":%"PRIu64",\"max_age\":%"PRIu64"}}\n",
+                            queue_bytes(queue), queue->retention.max_length, queue->retention.max_bytes, queue->retention.max_age);
+            request_reply(request, status_ok, info, len);
+            queue_forget(queue);
+            break;
+
+        default:
+            request_reply_static(request, reply_invalid_method);
+            break;
+    }
+
+    if (request->batched || request->nkeys) {
+        job_add(request);
+    }
+    else {
+        request_complete(request);
+    }
+
+    if (wake && wake->waiters) {
+        /* after the PUT joined its job, so the GETs read what it wrote */
+        queue_wake(wake);
+    }
+}
+
+/*
+ * GET ?subscribe=<credit> streams a queue over one chunked response. The
+ * loop of the connection reads messages from the loop of the queue, at
+ * most credit of them not written yet, and not while the socket has more
+ * than STREAM_WRITE_QUEUE_MAX bytes queued, so a slow consumer holds the
+ * messages back in the queue instead of in memory. A read of an empty
+ * queue waits like GET ?wait=. The response ends when the connection
+ * closes, or with a last chunk on error. Nothing sent after the subscribe
+ * is parsed.
+ */
+
+/* free a stream that is over once no read or write refers to it, returns 1 if it did */
+int stream_release(request_t *request)
+{
+    client_t *client = request->client;
+
+    if (request->stream.pulling || request->stream.writes) {
+        return 0;
+    }
+
+    if (!request->stream.ended && !uv_is_closing((uv_handle_t *)&client->handle)) {
+        return 0;
+    }
+
+    assert(client->head == request);
+    client->head = request->client_next;
+
+    if (!client->head) {
+        client->tail = &client->head;
+    }
+
+    /* the requests behind it, there is nobody to reply to anymore */
+    client_flush(client);
+    request_free(request);
+    return 1;
+}
+
+/* read the next messages of a stream if credit and the socket allow */
+void stream_pull(request_t *request)
+{
+    client_t *client = request->client;
+    stream_t *stream = &request->stream;
+    loop_t *owner;
+
+    if (stream->pulling || stream->ended || stream->inflight >= stream->credit) {
+        return;
+    }
+
+    if (uv_is_closing((uv_handle_t *)&client->handle) || client->handle.write_queue_size >= STREAM_WRITE_QUEUE_MAX) {
+        return;
+    }
+
+    stream->pulling = 1;
+    request->count = stream->credit - stream->inflight;
+    request->batched = 0;
+    request->nkeys = 0;
+    request->done = NULL;
+    request->chunk = NULL;
+    owner = loop_owner(request->qname, request->qname_length);
+
+    if (owner == loop_self) {
+        request_process(request);
+        return;
+    }
+
+    loop_post(owner, request);
+}
+
+void stream_after_write(uv_write_t *req, int status)
+{
+    stream_chunk_t *chunk = (stream_chunk_t *)req;
+    request_t *request = chunk->request;
+    uv_handle_t *handle = (uv_handle_t *)&request->client->handle;
+
+    if ((status || chunk->end) && !uv_is_closing(handle)) {
+        uv_close(handle, on_close);
+    }
+
+    request->stream.inflight -= chunk->n;
+    request->stream.writes--;
+    stream_chunk_free(chunk);
+
+    if (!stream_release(request)) {
+        stream_pull(request);
+    }
+}
+
+void stream_write(request_t *request, stream_chunk_t *chunk)
+{
+    uv_buf_t *bufs = chunk->bufs + 1;
+    unsigned int nbufs = chunk->nbufs;
+
+    if (!request->stream.started) {
+        bufs--;
+        nbufs++;
+        bufs[0] = reply_stream_head();
+        request->stream.started = 1;
+    }
+
+    if (chunk->end) {
+        request->stream.ended = 1;
+    }
+
+    chunk->request = request;
+    request->stream.inflight += chunk->n;
+    request->stream.writes++;
+    uv_write(&chunk->write_req, (uv_stream_t *)&request->client->handle, bufs, nbufs, stream_after_write);
+}
+
+/* a stream at the head of its client is ready: it just came in, or a read is back */
+void stream_flush(request_t *request)
+{
+    client_t *client = request->client;
+    stream_chunk_t *chunk = request->chunk;
+    request->ready = 0;
+    request->chunk = NULL;
+    request->stream.pulling = 0;
+
+    if (uv_is_closing((uv_handle_t *)&client->handle)) {
+        if (chunk) {
+            stream_chunk_free(chunk);
+        }
+
+        stream_release(request);
+        return;
+    }
+
+    if (!chunk && !request->stream.started) {
+        /* the header alone */
+        chunk = stream_chunk_new(0);
+    }
+
+    if (chunk) {
+        stream_write(request, chunk);
+    }
+
+    stream_pull(request);
+}
+
+/*
+ * OPTIONS / reports server counters, summed over all loops. Other loops
+ * keep counting meanwhile, so the numbers are a close snapshot only.
+ */
+void stats_reply(request_t *request)
+{
+    repbuf_t *repbuf = request->write_req.data;
+    uint64_t hits = 0, misses = 0, idle = 0, rhits = 0, rmisses = 0, ridle = 0, arena_mallocs = 0;
+    uint64_t chits = 0, cmisses = 0, cbytes = 0;
+    unsigned int i;
+    int len;
+
+    for (i = 0; i < nloops; i++) {
+        hits += loops[i].rbuf_hits;
+        misses += loops[i].rbuf_misses;
+        idle += loops[i].rbufs_idle;
+        rhits += loops[i].request_hits;
+        rmisses += loops[i].request_misses;
+        ridle += loops[i].requests_idle;
+        arena_mallocs += loops[i].arena_mallocs;
+        chits += loops[i].cache_hits;
+        cmisses += loops[i].cache_misses;
+        cbytes += loops[i].cache_bytes;
+    }
+
+    len = snprintf(repbuf->buf + BUFSIZE, BUFSIZE,
+                   "{\"threads\":%u,\"read_buffers\":{\"hits\":%"PRIu64",\"misses\":%"PRIu64",\"idle\":%"PRIu64"},"
+                   "\"requests\":{\"hits\":%"PRIu64",\"misses\":%"PRIu64",\"idle\":%"PRIu64",\"arena_mallocs\":%"PRIu64"},"
+                   "\"cache\":{\"hits\":%"PRIu64",\"misses\":%"PRIu64",\"bytes\":%"PRIu64"}}\n",
+                   nloops, hits, misses, idle, rhits, rmisses, ridle, arena_mallocs, chits, cmisses, cbytes);
+    request_reply(request, status_ok, repbuf->buf + BUFSIZE, len);
+}
+
+/* a request posted to this loop: either to run here, or its reply is back */
+void on_request_posted(request_t *request)
+{
+    if (request->loop == loop_self) {
+        request_ready(request);
+        return;
+    }
+
+    request_process(request);
+}
+
+/* the request is parsed, or given up on, and takes its place among the replies of its client */
+void request_push(request_t *request)
+{
+    client_t *client = request->client;
+    client->parser.data = client;
+    request->write_req.data = arena_alloc(&request->arena, BUFSIZE * 2);
+    *client->tail = request;
+    client->tail = &request->client_next;
+}
+
+/*
+ * The body is over max_message_size: answer right away and read nothing
+ * more from the client, the connection is closed once the reply is
+ * written. Returns what stops the parser.
+ */
+int request_too_large(request_t *request)
+{
+    client_t *client = request->client;
+    free(request->body_data);
+    request->body_data = NULL;
+
+    if (request->body_buf) {
+        rbuf_release(request->body_buf);
+        request->body_buf = NULL;
+    }
+
+    request->body = NULL;
+    request->body_length = 0;
+    request->body_size = 0;
+    request->keepalive = 0;
+    client->stopped = 1;
+    uv_read_stop((uv_stream_t *)&client->handle);
+    request_push(request);
+    request_reply_static(request, reply_too_large);
+    request_ready(request);
+    return -1;
+}
+
+int on_message_complete(http_parser *parser)
+{
+    request_t *request = (request_t *)parser->data;
+    loop_t *owner;
+    request_push(request);
+
+    if (request->qname_length == 0 && request->method == HTTP_OPTIONS) {
+        stats_reply(request);
+        request_ready(request);
+        return 0;
+    }
+
+    if (request->qname_length == 0 ||  strspn(request->qname, QUEUE_CHARS) != request->qname_length) {
+        /* invalid qname */
+        request_reply_static(request, reply_invalid_queue_name);
+        request_ready(request);
+        return 0;
+    }
+
+    if (request->stream.credit && request->method == HTTP_GET) {
+        /*
+         * stream_flush writes the header and starts reading. The response
+         * never ends, so requests pipelined behind it could never be
+         * answered: stop parsing, the parser error is not a close.
+         */
+        request->keepalive = 0;
+        request->reserve = 0;
+        request->wait = MAX_GET_WAIT;
+        request->client->stopped = 1;
+        request_ready(request);
+        return -1;
+    }
+
+    request->stream.credit = 0;
+    owner = loop_owner(request->qname, request->qname_length);
+
+    if (owner == loop_self) {
+        request_process(request);
+        return 0;
+    }
+
+    loop_post(owner, request);
+    return 0;
+}
+
+/* a listening socket of its own for every loop, the kernel spreads connections */
+int listen_socket(struct sockaddr_in address)
+{
+    int fd, on = 1;
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd < 0) {
+        terr(1, "socket");
+    }
+
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+        terr(1, "SO_REUSEADDR");
+    }
+
+#ifdef SO_REUSEPORT
+
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0) {
+        terr(1, "SO_REUSEPORT");
+    }
+
+#else
+    terrx(1, "threads > 1 needs SO_REUSEPORT");
+#endif
+
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        terr(1, "bind %s:%hu", conf->host, conf->port);
+    }
+
+    return fd;
+}
+
+static void sync_work_cb(uv_work_t *req)
+{
+    (void)req;
+    db_sync();
+}
+
+static void sync_after_work(uv_work_t *req, int status)
+{
+    (void)req;
+    (void)status;
+    sync_running = 0;
+}
+
+/* sync off the loop, a tick is skipped while the previous sync still runs */
+static void on_sync_timer(uv_timer_t *handle, int status)
+{
+    int r;
+    (void)status;
+
+    if (sync_running) {
+        return;
+    }
+
+    sync_running = 1;
+    r = uv_queue_work(handle->loop, &sync_work, sync_work_cb, sync_after_work);
+    uv_assert(r, "uv_queue_work");
+}
+
+void loop_setup(loop_t *loop)
+{
+    int r;
+    struct sockaddr_in address = uv_ip4_addr(conf->host, conf->port);
+    queue_init();
+    job_init(loop->loop, request_finish);
+    wheel_init(&loop->wheel, loop->loop);
+    reserve_init();
+    retain_init(loop->loop);
+    delay_init(loop->loop, queue_wake);
+    loop->flush_head = NULL;
+    uv_check_init(loop->loop, &loop->flush_check);
+    uv_check_start(&loop->flush_check, on_flush_check);
+
+    if (loop->id == 0 && conf->durability == durability_interval) {
+        uv_timer_init(loop->loop, &sync_timer);
+        uv_timer_start(&sync_timer, on_sync_timer, conf->durability_interval, conf->durability_interval);
+    }
+
+    r = uv_tcp_init(loop->loop, &loop->server);
+    uv_assert(r, "uv_tcp_init");
+    uv_tcp_keepalive(&loop->server, conf->tcp_keepalive, conf->tcp_keepalive);
+    uv_tcp_nodelay(&loop->server, conf->tcp_nodelay);
+
+    if (nloops > 1) {
+        r = uv_tcp_open(&loop->server, listen_socket(address));
+        uv_assert(r, "uv_tcp_open");
+    }
+    else {
+        r = uv_tcp_bind(&loop->server, address);
+        uv_assert(r, "uv_tcp_bind");
+    }
+
+    r = uv_listen((uv_stream_t *)&loop->server, 128, on_connect);
+    uv_assert(r, "uv_listen");
+}
+
+void loop_teardown(loop_t *loop)
+{
+    request_t *request;
+    /* first, answering what is left still runs the loop */
+    job_destroy();
+    delay_destroy();
+    retain_destroy();
+    reserve_destroy();
+    wheel_destroy(&loop->wheel);
+    queue_destroy();
+    rbuf_pool_destroy(loop);
+
+    while ((request = loop->requests)) {
+        loop->requests = request->next;
+        arena_destroy(&request->arena);
+        free(request);
+    }
+
+    loop->requests_idle = 0;
+}
+
+void signal_handler(int sig)
+{
+    loop_stop();
+    db_close();
+    terrx(sig, "receive signal %d, exited.", sig);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 2 && conf_loadfile(conf, argv[1]) != 0) {
+        terrx(1, "failed to load conf %s", argv[1]);
+    }
+
+    db_init(conf->engine);
+
+    switch (db_format()) {
+        case 0:
+            db_set_format();
+            break;
+
+        case KEY_FORMAT_VERSION:
+            break;
+
+        case 1:
+            terrx(1, "%s is in the old text format, convert it with levelq-migrate first", conf->db);
+
+        default:
+            terrx(1, "%s has an unknown format", conf->db);
+    }
+
+    reply_init();
+    parser_settings.on_message_begin = on_message_begin;
+    parser_settings.on_url = on_url;
+    parser_settings.on_header_field = on_header_field;
+    parser_settings.on_header_value = on_header_value;
+    parser_settings.on_body = on_body;
+    parser_settings.on_headers_complete = on_headers_complete;
+    parser_settings.on_message_complete = on_message_complete;
+    loop_init(conf->threads, on_request_posted);
+    printf("            levelq "LEVELQ_VERSION"\n");
+    printf("engine:                   : %s\n", conf->engine == engine_leveldb ? "leveldb" :
+           conf->engine == engine_lmdb ? "lmdb" :
            conf->engine == engine_unqlite ? "unqlite" :
            "unknown");
     printf("db                        : %s\n", conf->db);
     printf("tcp_keepalive             : %u\n", conf->tcp_keepalive);
     printf("tcp_nodelay               : %s\n", conf->tcp_nodelay ? "true" : "false");
     printf("delete_after_get          : %s\n", conf->delete_after_get ? "true" : "false");
+    printf("group_commit_delay        : %u\n", conf->group_commit_delay);
+    printf("group_commit_max          : %u\n", conf->group_commit_max);
+    printf("threads                   : %u\n", nloops);
+    printf("max_message_size          : %zu\n", conf->max_message_size);
+    printf("durability                : %s\n", conf->durability == durability_always ? "always" :
+           conf->durability == durability_interval ? "interval" : "none");
+
+    if (conf->durability == durability_interval) {
+        printf("durability_interval       : %u\n", conf->durability_interval);
+    }
+
+    printf("max_length                : %"PRIu64"\n", conf->retention.max_length);
+    printf("max_bytes                 : %"PRIu64"\n", conf->retention.max_bytes);
+    printf("max_age                   : %"PRIu64"\n", conf->retention.max_age);
+    printf("cache_size                : %zu\n", conf->cache_size);
+
 
     if (conf->engine == engine_leveldb) {
         printf("leveldb_cache_size        : %zu\n", conf->leveldb_cache_size);
@@ -459,6 +1894,9 @@ int main(int argc, char *argv[])
     }
     else if (conf->engine == engine_lmdb) {
         printf("lmdb_mapsize              : %zu\n", conf->lmdb_mapsize);
+        printf("lmdb_mapsize_step         : %zu\n", conf->lmdb_mapsize_step);
+        printf("lmdb_mapsize_max          : %zu\n", conf->lmdb_mapsize_max);
+        printf("lmdb_queue_dbs            : %u\n", conf->lmdb_queue_dbs);
     }
 
     printf("\n");
@@ -468,7 +1906,8 @@ int main(int argc, char *argv[])
     signal(SIGTERM, signal_handler);
     signal(SIGHUP, signal_handler);
     signal(SIGSEGV, signal_handler);
-    uv_run(uv_loop, UV_RUN_DEFAULT);
+    loop_run(loop_setup, loop_teardown);
+    db_sync();
     db_close();
     return 0;
 }
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "h.h"
+#include "db.h"
+#include "key.h"
+#include "conf.h"
+
+/*
+ * levelq-migrate converts a db written in the text key format (version 1)
+ * to the binary one levelq expects now. It works on a stopped server:
+ *
+ *     $ levelq-migrate levelq.conf
+ */
+
+#define MIGRATE_BATCH 10000
+
+typedef struct {
+    dbbatch_t *batch;
+    size_t converted;
+    size_t skipped;
+    size_t pending;
+    char last[MAX_KEY_LENGTH];
+    size_t last_length;
+} migrate_t;
+
+static int migrate_key(dbi_t *key, dbi_t *val, void *arg)
+{
+    migrate_t *m = arg;
+    char buf[MAX_KEY_LENGTH], meta[META_MAX_LENGTH], tmp[48] = {0};
+    const char *colon;
+    uint64_t getpos, putpos, pos;
+    lane_t lanes[QUEUE_LANES];
+    dbi_t k, v;
+    int i;
+
+    if (!key_is_text(key->data, key->len)) {
+        return 0;
+    }
+
+    colon = memchr(key->data, ':', key->len);
+    k.data = buf;
+
+    if (colon == NULL) {
+        /* queue meta, "getpos,putpos" */
+        memcpy(tmp, val->data, val->len < sizeof(tmp) - 1 ? val->len : sizeof(tmp) - 1);
+
+        if (key->len > MAX_QNAME_LENGTH || sscanf(tmp, "%"SCNu64",%"SCNu64, &getpos, &putpos) != 2) {
+            twarnx("skip invalid key: %.*s", (int)key->len, key->data);
+            m->skipped++;
+            return 0;
+        }
+
+        /* version 1 had no lanes, it all goes to the default one */
+        for (i = 0; i < QUEUE_LANES; i++) {
+            lanes[i].getpos = lanes[i].putpos = lanes[i].ackpos = LANE_BASE(i);
+            lanes[i].bytes = 0;
+        }
+
+        lanes[0].getpos = lanes[0].ackpos = getpos;
+        lanes[0].putpos = putpos;
+        k.len = key_meta(buf, key->data, key->len);
+        v.data = meta;
+        v.len = meta_encode(meta, lanes);
+    }
+    else {
+        /* queue item, "name:pos" */
+        size_t len = colon - key->data;
+        memcpy(tmp, colon + 1, key->len - len - 1 < sizeof(tmp) - 1 ? key->len - len - 1 : sizeof(tmp) - 1);
+
+        if (len == 0 || len > MAX_QNAME_LENGTH || sscanf(tmp, "%"SCNu64, &pos) != 1) {
+            twarnx("skip invalid key: %.*s", (int)key->len, key->data);
+            m->skipped++;
+            return 0;
+        }
+
+        k.len = key_item(buf, key->data, len, pos);
+        v.data = val->data;
+        v.len = val->len;
+    }
+
+    dbbatch_put(m->batch, &k, &v);
+    dbbatch_delete(m->batch, key);
+    m->converted++;
+    memcpy(m->last, key->data, key->len);
+    m->last_length = key->len;
+    return ++m->pending >= MIGRATE_BATCH;
+}
+
+int main(int argc, char *argv[])
+{
+    migrate_t m[1];
+    dbi_t start;
+    int r;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s levelq.conf\n", argv[0]);
+        return 1;
+    }
+
+    if (conf_loadfile(conf, argv[1]) != 0) {
+        terrx(1, "failed to load conf %s", argv[1]);
+    }
+
+    db_init(conf->engine);
+
+    switch (db_format()) {
+        case 0:
+        case KEY_FORMAT_VERSION:
+            printf("%s needs no migration\n", conf->db);
+            db_close();
+            return 0;
+
+        case 1:
+            break;
+
+        default:
+            db_close();
+            terrx(1, "%s has an unknown format", conf->db);
+    }
+
+    m->batch = dbbatch_new();
+    m->converted = m->skipped = 0;
+    m->last_length = 0;
+
+    /*
+     * Keys are converted in batches. Converted keys are deleted, so every
+     * pass picks up where the previous one stopped; engines without an
+     * order start over and skip the keys already converted.
+     */
+    do {
+        m->pending = 0;
+        start.data = m->last;
+        start.len = m->last_length;
+        r = db_iterate(m->last_length ? &start : NULL, migrate_key, m);
+
+        if (r < 0) {
+            terrx(1, "failed to read %s", conf->db);
+        }
+
+        if (m->batch->nops && db_commit(m->batch)) {
+            terrx(1, "failed to write %s", conf->db);
+        }
+
+        dbbatch_clear(m->batch);
+        printf("converted %zu keys\n", m->converted);
+    }
+    while (r > 0);
+
+    db_set_format();
+    dbbatch_destroy(m->batch);
+    db_close();
+
+    if (m->skipped) {
+        printf("skipped %zu invalid keys\n", m->skipped);
+    }
+
+    printf("%s is in format version %d now\n", conf->db, KEY_FORMAT_VERSION);
+    return 0;
+}
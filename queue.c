@@ -0,0 +1,565 @@
+#include <string.h>
+#include <assert.h>
+#include "queue.h"
+#include "db.h"
+#include "conf.h"
+#include "key.h"
+#include "reserve.h"
+#include "retain.h"
+#include "cache.h"
+#include "loop.h"
+#include "job.h"
+
+/*
+ * Resident table of queue positions. Positions are read from the db the
+ * first time a queue is touched and are authoritative in memory after that,
+ * every change is written through by queue_save() as part of the same batch
+ * as the items it covers. A queue has QUEUE_LANES priority lanes with
+ * positions of their own, ready has a bit for each lane with messages, so
+ * the lane a GET is served from is found without looking at the others.
+ *
+ * Sizes and put times of single messages are not kept. Instead a lane has
+ * a mark for every RETAIN_MARK ms of puts, with the position, the bytes put
+ * before it and the time. The bytes from getpos on and the age of a run of
+ * messages come from the marks, interpolated within a run, and marks are
+ * dropped as getpos passes them. A lane keeps at most RETAIN_MARKS_MAX, it
+ * gets coarser rather than bigger when nobody takes from it.
+ */
+
+#define QUEUE_TABLE_MIN_SIZE 64
+
+/* every loop thread has a table of the queues it owns */
+static __thread queue_t **table = NULL;
+static __thread size_t table_size = 0;
+static __thread size_t table_count = 0;
+
+uint32_t queue_hash(const char *name, size_t len)
+{
+    /* FNV-1a */
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+static void queue_table_grow()
+{
+    size_t i, size = table_size << 1;
+    queue_t **t = calloc(size, sizeof(queue_t *));
+    assert(t);
+
+    for (i = 0; i < table_size; i++) {
+        queue_t *q = table[i], *next;
+
+        while (q) {
+            uint32_t h = queue_hash(q->name, q->name_length) & (size - 1);
+            next = q->next;
+            q->next = t[h];
+            t[h] = q;
+            q = next;
+        }
+    }
+
+    free(table);
+    table = t;
+    table_size = size;
+}
+
+/* empty every lane, positions start over */
+void queue_reset(queue_t *queue)
+{
+    lane_t *lane;
+    int i;
+
+    for (i = 0; i < QUEUE_LANES; i++) {
+        lane = &queue->lanes[i];
+        lane->getpos = LANE_BASE(i);
+        lane->putpos = LANE_BASE(i);
+        lane->ackpos = LANE_BASE(i);
+        lane->bytes = 0;
+        lane->putbytes = 0;
+        lane->puttime = 0;
+        lane->mark_first = 0;
+        lane->mark_count = 0;
+    }
+
+    cache_drop(queue);
+    queue->ready = 0;
+}
+
+/* the bit of a lane in ready, after its positions changed */
+void queue_update(queue_t *queue, int lane)
+{
+    if (queue->lanes[lane].getpos < queue->lanes[lane].putpos) {
+        queue->ready |= 1u << lane;
+    }
+    else {
+        queue->ready &= ~(1u << lane);
+    }
+}
+
+/* the highest priority lane with messages, -1 if there are none */
+int queue_top(queue_t *queue)
+{
+    return queue->ready ? 31 - __builtin_clz(queue->ready) : -1;
+}
+
+/* start a new run of messages at putpos, unless the last one is recent */
+static void queue_mark(lane_t *lane, uint64_t now)
+{
+    mark_t *m;
+    size_t i;
+
+    if (lane->mark_count && lane->marks[lane->mark_first + lane->mark_count - 1].time + RETAIN_MARK > now) {
+        return;
+    }
+
+    if (lane->mark_count == RETAIN_MARKS_MAX) {
+        /* every other run joins the one before it */
+        for (i = 0; i < RETAIN_MARKS_MAX / 2; i++) {
+            lane->marks[i] = lane->marks[lane->mark_first + 2 * i];
+        }
+
+        lane->mark_first = 0;
+        lane->mark_count = RETAIN_MARKS_MAX / 2;
+    }
+    else if (lane->mark_first + lane->mark_count == lane->mark_size) {
+        if (lane->mark_first) {
+            memmove(lane->marks, lane->marks + lane->mark_first, lane->mark_count * sizeof(mark_t));
+            lane->mark_first = 0;
+        }
+        else {
+            lane->mark_size = lane->mark_size ? lane->mark_size << 1 : 8;
+            lane->marks = realloc(lane->marks, lane->mark_size * sizeof(mark_t));
+            assert(lane->marks);
+        }
+    }
+
+    m = &lane->marks[lane->mark_first + lane->mark_count++];
+    m->pos = lane->putpos;
+    m->bytes = lane->putbytes;
+    m->time = now;
+}
+
+/* putbytes of a lane before pos, from getpos to putpos */
+uint64_t queue_bytes_at(lane_t *lane, uint64_t pos)
+{
+    mark_t *m = lane->marks + lane->mark_first, *end = m + lane->mark_count;
+    uint64_t pos1 = lane->putpos, bytes1 = lane->putbytes;
+
+    if (!lane->mark_count) {
+        return lane->putbytes;
+    }
+
+    while (m + 1 < end && m[1].pos <= pos) {
+        m++;
+    }
+
+    if (m + 1 < end) {
+        pos1 = m[1].pos;
+        bytes1 = m[1].bytes;
+    }
+
+    if (pos <= m->pos) {
+        return m->bytes;
+    }
+
+    if (pos >= pos1) {
+        return bytes1;
+    }
+
+    return m->bytes + (uint64_t)((double)(bytes1 - m->bytes) * (pos - m->pos) / (pos1 - m->pos));
+}
+
+/* the first position of a lane that putbytes reach bytes before, at most putpos */
+uint64_t queue_pos_at(lane_t *lane, uint64_t bytes)
+{
+    mark_t *m = lane->marks + lane->mark_first, *end = m + lane->mark_count;
+    uint64_t pos, pos1 = lane->putpos, bytes1 = lane->putbytes;
+    double d;
+
+    if (!lane->mark_count || bytes >= lane->putbytes) {
+        return lane->putpos;
+    }
+
+    while (m + 1 < end && m[1].bytes <= bytes) {
+        m++;
+    }
+
+    if (m + 1 < end) {
+        pos1 = m[1].pos;
+        bytes1 = m[1].bytes;
+    }
+
+    if (bytes <= m->bytes) {
+        return m->pos;
+    }
+
+    d = (double)(pos1 - m->pos) * (bytes - m->bytes) / (bytes1 - m->bytes);
+    pos = m->pos + (uint64_t)d;
+    return (double)(pos - m->pos) < d ? pos + 1 : pos;
+}
+
+/* n messages, of bytes in all, were put to a lane at the positions from its putpos on */
+void queue_put(queue_t *queue, int i, uint64_t n, uint64_t bytes)
+{
+    lane_t *lane = &queue->lanes[i];
+    uint64_t now = uv_now(loop_self->loop);
+    queue_mark(lane, now);
+    lane->putpos += n;
+    lane->putbytes += bytes;
+    lane->bytes += bytes;
+    lane->puttime = now;
+    queue_update(queue, i);
+    retain_watch(queue);
+}
+
+/* the messages of a lane before pos are taken, or dropped */
+void queue_take(queue_t *queue, int i, uint64_t pos)
+{
+    lane_t *lane = &queue->lanes[i];
+    lane->getpos = pos;
+    cache_trim(queue, i, pos);
+
+    /* the first mark is the one of the run getpos is in */
+    while (lane->mark_count > 1 && lane->marks[lane->mark_first + 1].pos <= pos) {
+        lane->mark_first++;
+        lane->mark_count--;
+    }
+
+    if (pos == lane->putpos) {
+        lane->mark_first = 0;
+        lane->mark_count = 0;
+        lane->bytes = 0;
+        lane->putbytes = 0;
+    }
+    else {
+        lane->bytes = lane->putbytes - queue_bytes_at(lane, pos);
+    }
+
+    queue_update(queue, i);
+}
+
+/* messages left to get over all lanes */
+uint64_t queue_length(queue_t *queue)
+{
+    uint64_t n = 0;
+    int i;
+
+    for (i = 0; i < QUEUE_LANES; i++) {
+        n += queue->lanes[i].putpos - queue->lanes[i].getpos;
+    }
+
+    return n;
+}
+
+/* bytes of the messages left to get over all lanes */
+uint64_t queue_bytes(queue_t *queue)
+{
+    uint64_t n = 0;
+    int i;
+
+    for (i = 0; i < QUEUE_LANES; i++) {
+        n += queue->lanes[i].bytes;
+    }
+
+    return n;
+}
+
+static queue_t *queue_new(const char *name, size_t len)
+{
+    queue_t *q = malloc(sizeof(queue_t) + len);
+    int i;
+    assert(q);
+    memcpy(q->name, name, len);
+    q->name[len] = 0;
+    q->name_length = len;
+
+    for (i = 0; i < QUEUE_LANES; i++) {
+        q->lanes[i].cache = NULL;
+        q->lanes[i].marks = NULL;
+        q->lanes[i].mark_size = 0;
+    }
+
+    queue_reset(q);
+    q->retention = conf->retention;
+    q->reaping = 0;
+    q->admitted = 0;
+    q->reap_next = NULL;
+    q->delayed = 0;
+    q->delayseq = 0;
+    q->delayjob = 0;
+    q->savejob = 0;
+    q->exists = 0;
+    q->dirty = 0;
+    q->stale = 0;
+    q->waiters = NULL;
+    q->waiters_tail = &q->waiters;
+
+    for (i = 0; i < QUEUE_LANES; i++) {
+        q->lanes[i].unacked = NULL;
+        q->lanes[i].unacked_tail = &q->lanes[i].unacked;
+    }
+
+    q->redeliver = NULL;
+    q->redeliver_tail = &q->redeliver;
+    q->next = NULL;
+    return q;
+}
+
+/*
+ * Read positions of a queue from db, returns -1 on error. Messages from
+ * ackpos on that were handed out but not acked are delivered again.
+ */
+static int queue_load(queue_t *q)
+{
+    char buf[MAX_KEY_LENGTH];
+    dbi_t k, *vp;
+    lane_t *lane;
+    uint64_t now = uv_now(loop_self->loop);
+    int i;
+    k.data = buf;
+    k.len = key_meta(buf, q->name, q->name_length);
+    vp = db_get(&k);
+
+    if (vp->err != NULL) {
+        twarnx("%s", vp->err);
+        dbi_destroy(vp);
+        return -1;
+    }
+
+    if (vp->data == NULL) {
+        // key not exists
+        dbi_destroy(vp);
+        return 0;
+    }
+
+    if (meta_decode(vp->data, vp->len, q->lanes) < 0) {
+        twarnx("invalid meta of queue %s", q->name);
+        dbi_destroy(vp);
+        return -1;
+    }
+
+    dbi_destroy(vp);
+
+    for (i = 0; i < QUEUE_LANES; i++) {
+        lane = &q->lanes[i];
+
+        if (lane->ackpos < lane->getpos) {
+            lane->getpos = lane->ackpos;
+        }
+
+        if (lane->getpos < lane->putpos) {
+            /* put times are not stored, the messages in it count as put now */
+            lane->putbytes = lane->bytes;
+            lane->puttime = now;
+            queue_mark(lane, now);
+            lane->marks[lane->mark_first].pos = lane->getpos;
+            lane->marks[lane->mark_first].bytes = 0;
+        }
+
+        queue_update(q, i);
+    }
+
+    k.len = key_retention(buf, q->name, q->name_length);
+    vp = db_get(&k);
+
+    if (vp->err != NULL) {
+        twarnx("%s", vp->err);
+        dbi_destroy(vp);
+        return -1;
+    }
+
+    if (vp->data != NULL && vp->len >= RETENTION_LENGTH) {
+        q->retention.max_length = uint64_decode(vp->data);
+        q->retention.max_bytes = uint64_decode(vp->data + 8);
+        q->retention.max_age = uint64_decode(vp->data + 16);
+    }
+
+    dbi_destroy(vp);
+    q->exists = 1;
+    retain_watch(q);
+    return 0;
+}
+
+void queue_init()
+{
+    table_size = QUEUE_TABLE_MIN_SIZE;
+    table_count = 0;
+    table = calloc(table_size, sizeof(queue_t *));
+    assert(table);
+}
+
+/*
+ * Find a queue, loading it from db on first use.
+ * Returns -1 on db error, 1 if the queue does not exist (*queue is still
+ * set, with zero positions, and is to be handed to queue_forget() unless
+ * the request creates it or waits on it) and 0 if it exists.
+ */
+int queue_lookup(const char *name, size_t len, queue_t **queue)
+{
+    uint32_t h = queue_hash(name, len);
+    queue_t *q = table[h & (table_size - 1)];
+
+    while (q) {
+        if (q->name_length == len && !memcmp(q->name, name, len)) {
+            if (q->stale) {
+                reserve_purge(q);
+                queue_reset(q);
+                q->retention = conf->retention;
+                q->exists = 0;
+
+                if (queue_load(q) < 0) {
+                    return -1;
+                }
+
+                q->stale = 0;
+            }
+
+            *queue = q;
+            return q->exists ? 0 : 1;
+        }
+
+        q = q->next;
+    }
+
+    q = queue_new(name, len);
+
+    if (queue_load(q) < 0) {
+        free(q);
+        return -1;
+    }
+
+    if (table_count >= table_size) {
+        queue_table_grow();
+    }
+
+    q->next = table[h & (table_size - 1)];
+    table[h & (table_size - 1)] = q;
+    table_count++;
+    *queue = q;
+    return q->exists ? 0 : 1;
+}
+
+/* add the current positions of a queue to a write batch */
+void queue_save(queue_t *queue, dbbatch_t *batch)
+{
+    dbi_t key, val;
+    char k[MAX_KEY_LENGTH], v[META_MAX_LENGTH];
+    val.data = v;
+    val.len = meta_encode(v, queue->lanes);
+    key.data = k;
+    key.len = key_meta(k, queue->name, queue->name_length);
+    dbbatch_put(batch, &key, &val);
+    job_queue(queue);
+}
+
+/* add the retention limits of a queue to a write batch, they are its own from now on */
+void queue_save_retention(queue_t *queue, dbbatch_t *batch)
+{
+    dbi_t key, val;
+    char k[MAX_KEY_LENGTH], v[RETENTION_LENGTH];
+    uint64_encode(v, queue->retention.max_length);
+    uint64_encode(v + 8, queue->retention.max_bytes);
+    uint64_encode(v + 16, queue->retention.max_age);
+    val.data = v;
+    val.len = RETENTION_LENGTH;
+    key.data = k;
+    key.len = key_retention(k, queue->name, queue->name_length);
+    dbbatch_put(batch, &key, &val);
+}
+
+/*
+ * Move ackpos of each lane up to its oldest unacked message, deleting the
+ * messages it passes.
+ */
+void queue_ack(queue_t *queue, dbbatch_t *batch)
+{
+    char k[MAX_KEY_LENGTH];
+    lane_t *lane;
+    dbi_t key;
+    uint64_t pos;
+    int i;
+    key.data = k;
+
+    for (i = 0; i < QUEUE_LANES; i++) {
+        lane = &queue->lanes[i];
+        pos = lane->unacked ? lane->unacked->pos : lane->getpos;
+
+        if (conf->delete_after_get) {
+            for (; lane->ackpos < pos; lane->ackpos++) {
+                key.len = key_item(k, queue->name, queue->name_length, lane->ackpos);
+                dbbatch_delete(batch, &key);
+            }
+        }
+
+        lane->ackpos = pos;
+    }
+}
+
+/* forget the in-memory positions and payloads, e.g. after a failed commit */
+void queue_invalidate(queue_t *queue)
+{
+    queue->stale = 1;
+    cache_drop(queue);
+}
+
+static void queue_free(queue_t *queue)
+{
+    int i;
+    cache_drop(queue);
+
+    for (i = 0; i < QUEUE_LANES; i++) {
+        free(queue->lanes[i].marks);
+    }
+
+    free(queue);
+}
+
+/*
+ * Drop a queue that does not exist from the table, unless something still
+ * refers to it, so lookups of names nobody writes do not pile up. One that
+ * a job ever wrote is kept, that job may not have run yet.
+ */
+void queue_forget(queue_t *queue)
+{
+    queue_t **p;
+
+    if (queue->exists || queue->waiters || queue->delayed || queue->reaping || queue->savejob) {
+        return;
+    }
+
+    p = &table[queue_hash(queue->name, queue->name_length) & (table_size - 1)];
+
+    while (*p != queue) {
+        p = &(*p)->next;
+    }
+
+    *p = queue->next;
+    table_count--;
+    queue_free(queue);
+}
+
+void queue_destroy()
+{
+    size_t i;
+
+    for (i = 0; i < table_size; i++) {
+        queue_t *q = table[i], *next;
+
+        while (q) {
+            next = q->next;
+            queue_free(q);
+            q = next;
+        }
+    }
+
+    free(table);
+    table = NULL;
+    table_size = table_count = 0;
+}
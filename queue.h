@@ -0,0 +1,25 @@
+#ifndef _QUEUE_H_
+#define _QUEUE_H_
+
+#include "h.h"
+
+void queue_init();
+uint32_t queue_hash(const char *name, size_t len);
+int queue_lookup(const char *name, size_t len, queue_t **queue);
+void queue_reset(queue_t *queue);
+void queue_update(queue_t *queue, int lane);
+int queue_top(queue_t *queue);
+uint64_t queue_length(queue_t *queue);
+uint64_t queue_bytes(queue_t *queue);
+uint64_t queue_bytes_at(lane_t *lane, uint64_t pos);
+uint64_t queue_pos_at(lane_t *lane, uint64_t bytes);
+void queue_put(queue_t *queue, int lane, uint64_t n, uint64_t bytes);
+void queue_take(queue_t *queue, int lane, uint64_t pos);
+void queue_save(queue_t *queue, dbbatch_t *batch);
+void queue_save_retention(queue_t *queue, dbbatch_t *batch);
+void queue_ack(queue_t *queue, dbbatch_t *batch);
+void queue_invalidate(queue_t *queue);
+void queue_forget(queue_t *queue);
+void queue_destroy();
+
+#endif
@@ -0,0 +1,68 @@
+#include <assert.h>
+#include "rbuf.h"
+
+/*
+ * Read buffers. Every loop keeps a free list of up to RBUF_POOL_MAX idle
+ * buffers, so a read reuses the memory the last one released instead of
+ * going to malloc. A buffer is referenced by the read that fills it and by
+ * each request whose body points into it; requests keep their body without
+ * a copy and the buffer goes back to the pool when the last one is done.
+ * Buffers are only touched by the loop they belong to.
+ */
+
+rbuf_t *rbuf_get(loop_t *loop)
+{
+    rbuf_t *rbuf = loop->rbufs;
+
+    if (rbuf) {
+        loop->rbufs = rbuf->next;
+        loop->rbufs_idle--;
+        loop->rbuf_hits++;
+    }
+    else {
+        rbuf = malloc(sizeof(rbuf_t));
+        assert(rbuf);
+        rbuf->loop = loop;
+        loop->rbuf_misses++;
+    }
+
+    rbuf->next = NULL;
+    rbuf->refs = 1;
+    return rbuf;
+}
+
+void rbuf_ref(rbuf_t *rbuf)
+{
+    rbuf->refs++;
+}
+
+void rbuf_release(rbuf_t *rbuf)
+{
+    loop_t *loop = rbuf->loop;
+
+    if (--rbuf->refs) {
+        return;
+    }
+
+    if (loop->rbufs_idle >= RBUF_POOL_MAX) {
+        free(rbuf);
+        return;
+    }
+
+    rbuf->next = loop->rbufs;
+    loop->rbufs = rbuf;
+    loop->rbufs_idle++;
+}
+
+void rbuf_pool_destroy(loop_t *loop)
+{
+    rbuf_t *rbuf, *next;
+
+    for (rbuf = loop->rbufs; rbuf; rbuf = next) {
+        next = rbuf->next;
+        free(rbuf);
+    }
+
+    loop->rbufs = NULL;
+    loop->rbufs_idle = 0;
+}
@@ -0,0 +1,11 @@
+#ifndef _RBUF_H_
+#define _RBUF_H_
+
+#include "h.h"
+
+rbuf_t *rbuf_get(loop_t *loop);
+void rbuf_ref(rbuf_t *rbuf);
+void rbuf_release(rbuf_t *rbuf);
+void rbuf_pool_destroy(loop_t *loop);
+
+#endif
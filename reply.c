@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "reply.h"
+
+/*
+ * Response headers. Everything but Content-Length is known per status, so
+ * the text before and after it is built once here, and a header is two
+ * copies around the digits. Replies whose body never changes are built
+ * whole, once for keep-alive and once for close.
+ */
+
+static const char *status_lines[status_count] = {
+    "HTTP/1.1 200 OK\r\n",
+    "HTTP/1.1 400 Bad Request\r\n",
+    "HTTP/1.1 404 NOT FOUND\r\n",
+    "HTTP/1.1 413 Request Entity Too Large\r\n",
+    "HTTP/1.1 500 Internal Server Error\r\n",
+    "HTTP/1.1 503 Service Unavailable\r\n"
+};
+
+static const struct {
+    status_t status;
+    const char *body;
+} static_replies[reply_count] = {
+    {status_ok, "OK"},
+    {status_not_found, "QUEUE NOT EXISTS"},
+    {status_not_found, "QUEUE EMPTY"},
+    {status_bad_request, "INVALID QUEUE NAME"},
+    {status_bad_request, "INVALID METHOD"},
+    {status_bad_request, "INVALID BATCH"},
+    {status_bad_request, "EMPTY BATCH"},
+    {status_too_large, "MESSAGE TOO LARGE"},
+    {status_not_found, "NOT RESERVED"},
+    {status_error, "Internal Server Error"},
+    {status_unavailable, "TOO MANY QUEUES"}
+};
+
+static const char connection_lines[2][32] = {
+    "\r\nConnection: close\r\n",
+    "\r\nConnection: keep-alive\r\n"
+};
+
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static char heads[status_count][BUFSIZE];
+static size_t head_lengths[status_count];
+static char tails[2][BUFSIZE];
+static size_t tail_lengths[2];
+static uv_buf_t replies[reply_count][2];
+static char stream_head[BUFSIZE];
+static size_t stream_head_length;
+
+/* decimal digits of v, two at a time, returns how many were written */
+size_t reply_uint(char *buf, uint64_t v)
+{
+    char tmp[20], *p = tmp + sizeof(tmp);
+    size_t len;
+
+    while (v >= 100) {
+        unsigned int i = (v % 100) * 2;
+        v /= 100;
+        *--p = digit_pairs[i + 1];
+        *--p = digit_pairs[i];
+    }
+
+    if (v >= 10) {
+        *--p = digit_pairs[v * 2 + 1];
+        *--p = digit_pairs[v * 2];
+    }
+    else {
+        *--p = '0' + v;
+    }
+
+    len = tmp + sizeof(tmp) - p;
+    memcpy(buf, p, len);
+    return len;
+}
+
+/* hex digits of v, for chunk sizes */
+size_t reply_hex(char *buf, uint64_t v)
+{
+    char tmp[16], *p = tmp + sizeof(tmp);
+    size_t len;
+
+    do {
+        *--p = "0123456789abcdef"[v & 15];
+        v >>= 4;
+    } while (v);
+
+    len = tmp + sizeof(tmp) - p;
+    memcpy(buf, p, len);
+    return len;
+}
+
+/* write the header of a reply to buf, which takes BUFSIZE bytes */
+size_t reply_header(char *buf, status_t status, size_t body_length, int keepalive)
+{
+    char *p = buf;
+    memcpy(p, heads[status], head_lengths[status]);
+    p += head_lengths[status];
+    p += reply_uint(p, body_length);
+    memcpy(p, tails[keepalive != 0], tail_lengths[keepalive != 0]);
+    p += tail_lengths[keepalive != 0];
+    return p - buf;
+}
+
+/* like reply_header, with an X-Position header for GET ?reserve= */
+size_t reply_header_position(char *buf, status_t status, size_t body_length, int keepalive, uint64_t pos)
+{
+    char *p = buf;
+    memcpy(p, heads[status], head_lengths[status]);
+    p += head_lengths[status];
+    p += reply_uint(p, body_length);
+    memcpy(p, "\r\nX-Position: ", 14);
+    p += 14;
+    p += reply_uint(p, pos);
+    memcpy(p, tails[keepalive != 0], tail_lengths[keepalive != 0]);
+    p += tail_lengths[keepalive != 0];
+    return p - buf;
+}
+
+uv_buf_t reply_static(reply_t reply, int keepalive)
+{
+    return replies[reply][keepalive != 0];
+}
+
+/* header of a chunked response that lasts until the connection closes */
+uv_buf_t reply_stream_head()
+{
+    uv_buf_t buf;
+    buf.base = stream_head;
+    buf.len = stream_head_length;
+    return buf;
+}
+
+void reply_init()
+{
+    size_t i, len, body_length;
+    int k;
+
+    for (i = 0; i < status_count; i++) {
+        head_lengths[i] = snprintf(heads[i], BUFSIZE, "%s" HEADER_HEAD, status_lines[i]);
+    }
+
+    for (k = 0; k < 2; k++) {
+        tail_lengths[k] = snprintf(tails[k], BUFSIZE, "%s" HEADER_TAIL, connection_lines[k]);
+    }
+
+    stream_head_length = snprintf(stream_head, BUFSIZE, "%sServer: levelq/"LEVELQ_VERSION"\r\n"
+                                  "Content-Type: application/octet-stream\r\n"
+                                  "Transfer-Encoding: chunked\r\n"
+                                  "Connection: close\r\n" HEADER_TAIL, status_lines[status_ok]);
+
+    for (i = 0; i < reply_count; i++) {
+        body_length = strlen(static_replies[i].body);
+
+        for (k = 0; k < 2; k++) {
+            char *buf = malloc(BUFSIZE + body_length);
+            assert(buf);
+            len = reply_header(buf, static_replies[i].status, body_length, k);
+            memcpy(buf + len, static_replies[i].body, body_length);
+            replies[i][k].base = buf;
+            replies[i][k].len = len + body_length;
+        }
+    }
+}
@@ -0,0 +1,14 @@
+#ifndef _REPLY_H_
+#define _REPLY_H_
+
+#include "h.h"
+
+void reply_init();
+size_t reply_header(char *buf, status_t status, size_t body_length, int keepalive);
+size_t reply_header_position(char *buf, status_t status, size_t body_length, int keepalive, uint64_t pos);
+uv_buf_t reply_static(reply_t reply, int keepalive);
+size_t reply_uint(char *buf, uint64_t v);
+size_t reply_hex(char *buf, uint64_t v);
+uv_buf_t reply_stream_head();
+
+#endif
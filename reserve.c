@@ -0,0 +1,194 @@
+#include <string.h>
+#include <assert.h>
+#include "reserve.h"
+#include "loop.h"
+#include "wheel.h"
+
+/*
+ * Reservations of the queues a loop owns. Each lane of a queue keeps its
+ * unacked messages in position order, which is the order they were first
+ * reserved in, so the oldest one is the next ackpos of the lane. Ones whose visibility timeout
+ * ran out are also on the redeliver list of the queue and are reserved
+ * again before new messages, without looking at the others. A table by
+ * queue and position finds the reservation an ack is for.
+ */
+
+#define RESERVE_TABLE_MIN_SIZE 1024
+
+static __thread reservation_t **table = NULL;
+static __thread size_t table_size = 0;
+static __thread size_t table_count = 0;
+
+static size_t reserve_hash(queue_t *queue, uint64_t pos)
+{
+    uint64_t h = ((uintptr_t)queue >> 4) ^ (pos * 0x9e3779b97f4a7c15ull);
+    return (size_t)(h ^ (h >> 32));
+}
+
+static void reserve_table_grow()
+{
+    size_t i, size = table_size << 1;
+    reservation_t **t = calloc(size, sizeof(reservation_t *));
+    assert(t);
+
+    for (i = 0; i < table_size; i++) {
+        reservation_t *r = table[i], *next;
+
+        while (r) {
+            size_t h = reserve_hash(r->queue, r->pos) & (size - 1);
+            next = r->hash_next;
+            r->hash_next = t[h];
+            t[h] = r;
+            r = next;
+        }
+    }
+
+    free(table);
+    table = t;
+    table_size = size;
+}
+
+void reserve_init()
+{
+    table_size = RESERVE_TABLE_MIN_SIZE;
+    table_count = 0;
+    table = calloc(table_size, sizeof(reservation_t *));
+    assert(table);
+}
+
+/* reserve a message handed out for the first time, its position is the highest yet */
+reservation_t *reserve_new(queue_t *queue, uint64_t pos)
+{
+    reservation_t *r = malloc(sizeof(reservation_t));
+    lane_t *lane = &queue->lanes[LANE_OF(pos)];
+    size_t h;
+    assert(r);
+    r->queue = queue;
+    r->pos = pos;
+    r->redeliver_next = NULL;
+    r->redeliver_pprev = NULL;
+    r->timeout.next = NULL;
+    r->timeout.pprev = NULL;
+    r->next = NULL;
+    r->pprev = lane->unacked_tail;
+    *lane->unacked_tail = r;
+    lane->unacked_tail = &r->next;
+
+    if (table_count >= table_size) {
+        reserve_table_grow();
+    }
+
+    h = reserve_hash(queue, pos) & (table_size - 1);
+    r->hash_next = table[h];
+    table[h] = r;
+    table_count++;
+    return r;
+}
+
+reservation_t *reserve_find(queue_t *queue, uint64_t pos)
+{
+    reservation_t *r = table[reserve_hash(queue, pos) & (table_size - 1)];
+
+    while (r && (r->queue != queue || r->pos != pos)) {
+        r = r->hash_next;
+    }
+
+    return r;
+}
+
+static void reserve_unlink_redeliver(reservation_t *r)
+{
+    *r->redeliver_pprev = r->redeliver_next;
+
+    if (r->redeliver_next) {
+        r->redeliver_next->redeliver_pprev = r->redeliver_pprev;
+    }
+    else {
+        r->queue->redeliver_tail = r->redeliver_pprev;
+    }
+
+    r->redeliver_next = NULL;
+    r->redeliver_pprev = NULL;
+}
+
+/* the oldest message to deliver again, reserved anew; NULL if there is none */
+reservation_t *reserve_next(queue_t *queue)
+{
+    reservation_t *r = queue->redeliver;
+
+    if (r) {
+        reserve_unlink_redeliver(r);
+    }
+
+    return r;
+}
+
+/* the visibility timeout ran out, the message is to be delivered again */
+void reserve_expire(reservation_t *r)
+{
+    r->redeliver_next = NULL;
+    r->redeliver_pprev = r->queue->redeliver_tail;
+    *r->queue->redeliver_tail = r;
+    r->queue->redeliver_tail = &r->redeliver_next;
+}
+
+/* the message is acked, or its queue is gone */
+void reserve_free(reservation_t *r)
+{
+    queue_t *queue = r->queue;
+    reservation_t **p = &table[reserve_hash(queue, r->pos) & (table_size - 1)];
+
+    while (*p != r) {
+        p = &(*p)->hash_next;
+    }
+
+    *p = r->hash_next;
+    table_count--;
+    *r->pprev = r->next;
+
+    if (r->next) {
+        r->next->pprev = r->pprev;
+    }
+    else {
+        queue->lanes[LANE_OF(r->pos)].unacked_tail = r->pprev;
+    }
+
+    if (r->redeliver_pprev) {
+        reserve_unlink_redeliver(r);
+    }
+
+    wheel_remove(&loop_self->wheel, &r->timeout);
+    free(r);
+}
+
+/* forget every reservation of a queue, its positions start over */
+void reserve_purge(queue_t *queue)
+{
+    int i;
+
+    for (i = 0; i < QUEUE_LANES; i++) {
+        while (queue->lanes[i].unacked) {
+            reserve_free(queue->lanes[i].unacked);
+        }
+    }
+}
+
+void reserve_destroy()
+{
+    size_t i;
+
+    for (i = 0; i < table_size; i++) {
+        reservation_t *r = table[i], *next;
+
+        while (r) {
+            next = r->hash_next;
+            wheel_remove(&loop_self->wheel, &r->timeout);
+            free(r);
+            r = next;
+        }
+    }
+
+    free(table);
+    table = NULL;
+    table_size = table_count = 0;
+}
@@ -0,0 +1,15 @@
+#ifndef _RESERVE_H_
+#define _RESERVE_H_
+
+#include "h.h"
+
+void reserve_init();
+reservation_t *reserve_new(queue_t *queue, uint64_t pos);
+reservation_t *reserve_find(queue_t *queue, uint64_t pos);
+reservation_t *reserve_next(queue_t *queue);
+void reserve_expire(reservation_t *reservation);
+void reserve_free(reservation_t *reservation);
+void reserve_purge(queue_t *queue);
+void reserve_destroy();
+
+#endif
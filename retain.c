@@ -0,0 +1,191 @@
+#include "retain.h"
+#include "queue.h"
+#include "db.h"
+#include "key.h"
+#include "job.h"
+#include "loop.h"
+#include "conf.h"
+
+/*
+ * Retention limits. A queue that has limits is put on the reaper list of
+ * its loop when messages are put to it. Every RETAIN_INTERVAL ms the
+ * reaper drops what is over the limits of each queue on the list: messages
+ * older than max_age first, then the oldest messages of the lowest
+ * priority until the queue is within max_length and max_bytes. Dropping
+ * advances getpos, the items are deleted in the open batch and committed
+ * by the storage job like any other write, at most RETAIN_REAP_MAX per run.
+ * Queues leave the list once they are within their limits, unless they
+ * have a max_age and still hold messages.
+ */
+
+static __thread queue_t *reap_head = NULL;
+static __thread uv_timer_t reap_timer;
+
+/* where each lane of a queue has to start for the queue to be within its limits */
+static void retain_cut(queue_t *queue, uint64_t *cut)
+{
+    retention_t *r = &queue->retention;
+    uint64_t now, cutoff, excess, n;
+    lane_t *lane;
+    mark_t *m;
+    size_t j;
+    int i;
+
+    for (i = 0; i < QUEUE_LANES; i++) {
+        cut[i] = queue->lanes[i].getpos;
+    }
+
+    now = uv_now(loop_self->loop);
+
+    if (r->max_age && now > r->max_age) {
+        /* whole runs that were put before the cutoff */
+        cutoff = now - r->max_age;
+
+        for (i = 0; i < QUEUE_LANES; i++) {
+            lane = &queue->lanes[i];
+            m = lane->marks + lane->mark_first;
+
+            for (j = 0; j < lane->mark_count; j++) {
+                if ((j + 1 < lane->mark_count ? m[j + 1].time : lane->puttime) > cutoff) {
+                    break;
+                }
+
+                cut[i] = j + 1 < lane->mark_count ? m[j + 1].pos : lane->putpos;
+            }
+        }
+    }
+
+    if (r->max_length) {
+        for (n = 0, i = 0; i < QUEUE_LANES; i++) {
+            n += queue->lanes[i].putpos - cut[i];
+        }
+
+        for (excess = n > r->max_length ? n - r->max_length : 0, i = 0; excess && i < QUEUE_LANES; i++) {
+            n = queue->lanes[i].putpos - cut[i];
+            n = n < excess ? n : excess;
+            cut[i] += n;
+            excess -= n;
+        }
+    }
+
+    if (r->max_bytes) {
+        for (n = 0, i = 0; i < QUEUE_LANES; i++) {
+            n += queue->lanes[i].putbytes - queue_bytes_at(&queue->lanes[i], cut[i]);
+        }
+
+        for (excess = n > r->max_bytes ? n - r->max_bytes : 0, i = 0; excess && i < QUEUE_LANES; i++) {
+            lane = &queue->lanes[i];
+            n = lane->putbytes - queue_bytes_at(lane, cut[i]);
+
+            if (n <= excess) {
+                cut[i] = lane->putpos;
+                excess -= n;
+            }
+            else {
+                cut[i] = queue_pos_at(lane, queue_bytes_at(lane, cut[i]) + excess);
+                excess = 0;
+            }
+        }
+    }
+}
+
+/* drop what is over the limits of a queue, returns whether to look at it again */
+static int retain_queue(queue_t *queue, uint64_t *budget)
+{
+    char k[MAX_KEY_LENGTH];
+    uint64_t cut[QUEUE_LANES], n, pos, dropped = 0;
+    lane_t *lane;
+    dbi_t key;
+    int i;
+
+    if (queue->stale && queue_lookup(queue->name, queue->name_length, &queue) < 0) {
+        return 1;
+    }
+
+    retain_cut(queue, cut);
+    key.data = k;
+
+    for (i = 0; i < QUEUE_LANES && *budget; i++) {
+        lane = &queue->lanes[i];
+        n = cut[i] > lane->getpos ? cut[i] - lane->getpos : 0;
+        n = n < *budget ? n : *budget;
+
+        if (!n) {
+            continue;
+        }
+
+        if (!conf->delete_after_get) {
+            /* queue_ack deletes what it passes otherwise */
+            for (pos = lane->getpos; pos < lane->getpos + n; pos++) {
+                key.len = key_item(k, queue->name, queue->name_length, pos);
+                dbbatch_delete(batch, &key);
+            }
+        }
+
+        queue_take(queue, i, lane->getpos + n);
+        *budget -= n;
+        dropped += n;
+    }
+
+    if (dropped) {
+        queue_ack(queue, batch);
+        queue_save(queue, batch);
+        job_write();
+    }
+
+    return !*budget || (queue->ready && queue->retention.max_age);
+}
+
+static void on_reap_timer(uv_timer_t *handle, int status)
+{
+    uint64_t budget = RETAIN_REAP_MAX;
+    queue_t *queue, **p = &reap_head;
+    (void)handle;
+    (void)status;
+
+    /* what does not fit in the budget is left for the next run */
+    while (budget && (queue = *p)) {
+        if (retain_queue(queue, &budget)) {
+            p = &queue->reap_next;
+        }
+        else {
+            *p = queue->reap_next;
+            queue->reap_next = NULL;
+            queue->reaping = 0;
+        }
+    }
+
+    if (!reap_head) {
+        uv_timer_stop(&reap_timer);
+    }
+}
+
+void retain_init(uv_loop_t *loop)
+{
+    reap_head = NULL;
+    uv_timer_init(loop, &reap_timer);
+}
+
+/* messages were put to a queue, have the reaper look at it if it has limits */
+void retain_watch(queue_t *queue)
+{
+    retention_t *r = &queue->retention;
+
+    if (queue->reaping || !queue->ready || !(r->max_length || r->max_bytes || r->max_age)) {
+        return;
+    }
+
+    queue->reaping = 1;
+    queue->reap_next = reap_head;
+    reap_head = queue;
+
+    if (!uv_is_active((uv_handle_t *)&reap_timer)) {
+        uv_timer_start(&reap_timer, on_reap_timer, RETAIN_INTERVAL, RETAIN_INTERVAL);
+    }
+}
+
+void retain_destroy()
+{
+    uv_timer_stop(&reap_timer);
+    reap_head = NULL;
+}
@@ -0,0 +1,10 @@
+#ifndef _RETAIN_H_
+#define _RETAIN_H_
+
+#include "h.h"
+
+void retain_init(uv_loop_t *loop);
+void retain_watch(queue_t *queue);
+void retain_destroy();
+
+#endif
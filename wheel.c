@@ -0,0 +1,110 @@
+#include <string.h>
+#include "wheel.h"
+
+/*
+ * Hashed timer wheel. A timeout sits in the slot of the tick it expires at,
+ * modulo WHEEL_SLOTS, and ones further out than a turn of the wheel wait in
+ * their slot until a turn reaches their tick. A single uv timer drives the
+ * wheel and only runs while it holds timeouts, so any number of them costs
+ * one timer and adding or removing one is O(1). Timeouts fire up to a tick
+ * late. A wheel belongs to one loop and is only touched by it.
+ */
+
+static uint64_t wheel_now(wheel_t *wheel)
+{
+    return uv_now(wheel->timer.loop) / WHEEL_TICK;
+}
+
+static void on_wheel_timer(uv_timer_t *handle, int status)
+{
+    wheel_t *wheel = container_of(handle, wheel_t, timer);
+    uint64_t now = wheel_now(wheel);
+    wheel_entry_t **p, *entry;
+    (void)status;
+
+    if (now - wheel->tick > WHEEL_SLOTS) {
+        /* a turn visits every slot, that catches up with any delay */
+        wheel->tick = now - WHEEL_SLOTS;
+    }
+
+    while (wheel->count && wheel->tick < now) {
+        wheel->tick++;
+        p = &wheel->slots[wheel->tick & (WHEEL_SLOTS - 1)];
+
+        while ((entry = *p)) {
+            if (entry->expires > wheel->tick) {
+                p = &entry->next;
+                continue;
+            }
+
+            wheel_remove(wheel, entry);
+            entry->cb(entry);
+        }
+    }
+}
+
+void wheel_init(wheel_t *wheel, uv_loop_t *loop)
+{
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+    wheel->tick = 0;
+    wheel->count = 0;
+    uv_timer_init(loop, &wheel->timer);
+}
+
+/* call cb with entry in ms, entry must not be in a wheel */
+void wheel_add(wheel_t *wheel, wheel_entry_t *entry, uint64_t ms, wheel_cb cb)
+{
+    uint64_t now = wheel_now(wheel);
+    wheel_entry_t **slot;
+
+    if (!wheel->count) {
+        wheel->tick = now;
+        uv_timer_start(&wheel->timer, on_wheel_timer, WHEEL_TICK, WHEEL_TICK);
+    }
+
+    entry->expires = now + (ms + WHEEL_TICK - 1) / WHEEL_TICK;
+
+    if (entry->expires <= wheel->tick) {
+        entry->expires = wheel->tick + 1;
+    }
+
+    entry->cb = cb;
+    slot = &wheel->slots[entry->expires & (WHEEL_SLOTS - 1)];
+    entry->next = *slot;
+    entry->pprev = slot;
+
+    if (*slot) {
+        (*slot)->pprev = &entry->next;
+    }
+
+    *slot = entry;
+    wheel->count++;
+}
+
+/* cancel a timeout, nothing happens if it is not in the wheel */
+void wheel_remove(wheel_t *wheel, wheel_entry_t *entry)
+{
+    if (!entry->pprev) {
+        return;
+    }
+
+    *entry->pprev = entry->next;
+
+    if (entry->next) {
+        entry->next->pprev = entry->pprev;
+    }
+
+    entry->next = NULL;
+    entry->pprev = NULL;
+
+    if (--wheel->count == 0) {
+        uv_timer_stop(&wheel->timer);
+    }
+}
+
+void wheel_destroy(wheel_t *wheel)
+{
+    uv_timer_stop(&wheel->timer);
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+    wheel->count = 0;
+}
@@ -0,0 +1,11 @@
+#ifndef _WHEEL_H_
+#define _WHEEL_H_
+
+#include "h.h"
+
+void wheel_init(wheel_t *wheel, uv_loop_t *loop);
+void wheel_add(wheel_t *wheel, wheel_entry_t *entry, uint64_t ms, wheel_cb cb);
+void wheel_remove(wheel_t *wheel, wheel_entry_t *entry);
+void wheel_destroy(wheel_t *wheel);
+
+#endif